@@ -0,0 +1,470 @@
+/* Copyright messages and all buisness related headers go here
+ */
+/**
+ * @file bench.cpp
+ * This file contains the implementation of bench.exe, which times the
+ * phases of CSimpleCSV on synthetic score files.
+ *
+ * Each scenario generates a score file in $TMPDIR (or /tmp), then reads,
+ * sorts and saves it a number of times with a fresh CSimpleCSV. One JSON
+ * line is written to stdout per scenario and phase with the median and
+ * 99th percentile (nearest rank) of the runs, in milliseconds. Given a
+ * baseline file, a copy of an earlier output, any median slower than its
+ * baseline by more than the tolerance is reported on stderr. Times depend
+ * on the host the baseline was recorded on, so this is only a report unless
+ * --strict asks for it to fail the run.
+ *
+ * Options which grade-scores.exe also has mean the same here.
+ *
+ * Usage: bench.exe [-h] [-i runs] [-b baseline] [--tolerance percent]
+ *                  [--strict] [-t threads] [--mode mode] [-r rows]
+ *                  [-l min:max] [-s scores] [-d percent] [-e percent]
+ *                  [-p names]
+ *     -h          Show the usage and exit
+ *     -i runs     Timed runs of each scenario, after one untimed run
+ *     -b file     Baseline to compare the medians with
+ *     --tolerance percent
+ *                 Slowdown over the baseline reported as a regression
+ *     --strict    Fail the run on a regression
+ *     -t threads  Threads each file is read and sorted on, default 1, 0 for
+ *                 one per CPU. Run with 1, 2, 4 ... to see how they scale
+ *     --mode mode Sort algorithm: record, index, radix (default) or parallel
+ *     -r rows     Rows of a custom scenario, run instead of the built in ones
+ *     -l min:max  Name lengths of the custom scenario, uniformly distributed
+ *     -s scores   Distinct scores of the custom scenario
+ *     -d percent  Rows of the custom scenario repeating an earlier name
+ *     -e percent  Rows of the custom scenario ending in \r\n, not \n
+ *     -p names    Last and first names of the custom scenario are each drawn
+ *                 from this many, the first few far more often than the rest
+ *
+ * @version
+ */
+
+/* Project C++ library */
+#include "process.h"
+
+/* Constants */
+/* --------- */
+
+#define BENCH_RUNS      31 //!< Default timed runs of each scenario
+#define BENCH_TOLERANCE 50 //!< Default slowdown reported, in percent
+#define BENCH_SEED 0x2545f4914f6cdd1dULL //!< Generator seed of every file
+
+/* Enumerations */
+/* ------------ */
+
+/** Phases of CSimpleCSV which are timed */
+typedef enum
+{
+    PHASE_READ = 0, //!< CSimpleCSV::read()
+    PHASE_SORT,     //!< CSimpleCSV::sort()
+    PHASE_SAVE,     //!< CSimpleCSV::save()
+    PHASE_MAX       //!< Number of phases timed
+} e_phase;
+
+/* Structures */
+/* ---------- */
+
+/** Shape of a synthetic score file */
+struct s_scenario
+{
+    const char *name;          //!< Name of the scenario in the output
+    unsigned long long rows;   //!< Rows in the file
+    unsigned int name_min;     //!< Shortest name
+    unsigned int name_max;     //!< Longest name
+    unsigned long long scores; //!< Distinct scores, 0 to scores-1
+    unsigned int dups;         //!< Percent of rows repeating an earlier name
+    unsigned int crlf;         //!< Percent of rows ending in \r\n
+    unsigned int pool;         //!< Last and first names are each drawn from
+                               //!< this many, 0 for a new name every row
+};
+
+/* Global variables */
+/* ---------------- */
+
+/** Scenarios run unless a custom one is given */
+static const s_scenario g_scenarios[] =
+{
+    /* name      rows    names  scores   dups crlf pool */
+    { "narrow",  200000, 3, 12, 101,     0,   0,   0    },
+    { "wide",    200000, 3, 12, 1000000, 0,   0,   0    },
+    { "dups",    200000, 3, 12, 11,      50,  0,   0    },
+    { "long",    100000, 20, 60, 101,    10,  50,  0    },
+    { "skewed",  200000, 5, 14, 101,     0,   0,   1000 },
+};
+
+static const char *g_phases[PHASE_MAX] = { "read", "sort", "save" };
+
+static const char g_usage[] = "Usage: bench.exe [-h] [-i runs] [-b baseline] "
+                              "[--tolerance percent] [--strict] [-t threads] "
+                              "[--mode mode] [-r rows] [-l min:max] "
+                              "[-s scores] [-d percent] [-e percent] "
+                              "[-p names]";
+
+/* Macros, Functions and Classes */
+/* ----------------------------- */
+
+/** Next number of a xorshift64* sequence, the same on every platform so
+ * every run times the same files
+ * @param[in,out] s Generator state, never 0
+ * @return Pseudo random number
+ */
+static inline uint64_t next_random(uint64_t &s)
+{
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    return(s * 0x2545f4914f6cdd1dULL);
+}
+
+/** Append a random name of mixed case letters
+ * @param[in,out] out Text to append to
+ * @param[in,out] s   Generator state
+ * @param[in]     sc  Scenario giving the name lengths
+ */
+static void random_name(std::string &out, uint64_t &s, const s_scenario &sc)
+{
+    unsigned int n = sc.name_min +
+                     next_random(s) % (sc.name_max - sc.name_min + 1);
+    for (unsigned int i=0; i<n; ++i)
+    {
+        uint64_t r = next_random(s);
+        out += (char)(((r & 0x300) ? 'a' : 'A') + (r >> 32) % 26);
+    }
+}
+
+/** Pick a name from a pool, the first names of the pool far more often
+ * than the last ones, as common surnames are
+ * @param[in]     pool Names to pick from, not empty
+ * @param[in,out] s    Generator state
+ * @return Name picked
+ */
+static const std::string &pick_name(const std::vector<std::string> &pool,
+                                    uint64_t &s)
+{
+    /* The square of a uniform fraction crowds towards 0 */
+    double u = (next_random(s) >> 11) * (1.0/(1ULL << 53));
+    return(pool[(size_t)(u*u*pool.size())]);
+}
+
+/** Write the score file of a scenario
+ * @param[in] name File name
+ * @param[in] sc   Scenario
+ * @return TRUE if the file was written, FALSE otherwise
+ */
+static bool generate(const char *name, const s_scenario &sc)
+{
+    uint64_t s = BENCH_SEED; /* Generator state */
+    std::vector<std::string> seen; /* Names written so far */
+    std::vector<std::string> last(sc.pool), first(sc.pool); /* Name pools */
+    std::string row;
+    for (unsigned int i=0; i<sc.pool; ++i)
+    {
+        random_name(last[i], s, sc);
+        random_name(first[i], s, sc);
+    }
+    int fd = ::open(name, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0)
+        return(false);
+    CWriter o(fd);
+    for (unsigned long long i=0; i<sc.rows; ++i)
+    {
+        row.clear();
+        if (!seen.empty() && (next_random(s) % 100 < sc.dups))
+            row = seen[next_random(s) % seen.size()];
+        else if (sc.pool)
+        {
+            row = pick_name(last, s);
+            row += ", ";
+            row += pick_name(first, s);
+        }
+        else
+        {
+            random_name(row, s, sc);
+            row += ", ";
+            random_name(row, s, sc);
+            /* Only a sample is kept for repeating, it is enough to tie */
+            if (seen.size() < 4096)
+                seen.push_back(row);
+        }
+        row += ", " + std::to_string(next_random(s) % sc.scores);
+        row += (next_random(s) % 100 < sc.crlf) ? "\r\n" : "\n";
+        o.put(row.data(), row.size());
+    }
+    bool r = o.flush();
+    return((::close(fd) == 0) && r);
+}
+
+/** Milliseconds since an earlier time
+ * @param[in] t Earlier time
+ * @return Elapsed time in milliseconds
+ */
+static double elapsed(const std::chrono::steady_clock::time_point &t)
+{
+    return(std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - t).count());
+}
+
+/** Time one read, sort and save of a file
+ * @param[in]  name    Input file name
+ * @param[in]  output  Output file name
+ * @param[in]  threads Threads to read and sort on, see CSimpleCSV::threads()
+ * @param[in]  mode    Sort algorithm
+ * @param[out] ms      Time of each phase in milliseconds
+ * @return TRUE if every phase succeeded, FALSE otherwise
+ */
+static bool run(const char *name, const char *output, unsigned int threads,
+                e_sortmode mode, double ms[PHASE_MAX])
+{
+    CSimpleCSV csv; /* CSV file processor */
+    csv.threads(threads);
+    csv.sortmode(mode);
+    std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+    if (csv.read(name) == rwcode_FAIL)
+        return(false);
+    ms[PHASE_READ] = elapsed(t);
+    t = std::chrono::steady_clock::now();
+    csv.sort();
+    ms[PHASE_SORT] = elapsed(t);
+    t = std::chrono::steady_clock::now();
+    if (csv.save(output) == rwcode_FAIL)
+        return(false);
+    ms[PHASE_SAVE] = elapsed(t);
+    return(true);
+}
+
+/** Nearest rank percentile of a sorted sample
+ * @param[in] v Sorted sample, not empty
+ * @param[in] p Percentile, 0 to 100
+ * @return Smallest value at least p percent of the sample is not above
+ */
+static double percentile(const std::vector<double> &v, unsigned int p)
+{
+    size_t rank = (v.size()*p + 99)/100;
+    return(v[(rank > 0) ? rank-1 : 0]);
+}
+
+/** Median of the baseline for a scenario and phase run on as many threads
+ * @param[in]  base    Lines of the baseline file
+ * @param[in]  sc      Scenario name
+ * @param[in]  phase   Phase name
+ * @param[in]  threads Threads the phase ran on
+ * @param[out] ms      Median in milliseconds
+ * @return TRUE if the baseline has the scenario and phase on that many
+ *         threads, FALSE otherwise
+ */
+static bool baseline(const std::vector<std::string> &base, const char *sc,
+                     const char *phase, unsigned int threads, double &ms)
+{
+    std::string key = std::string("{\"case\":\"") + sc + "\",\"phase\":\"" +
+                      phase + "\",";
+    std::string run = ",\"threads\":" + std::to_string(threads) + ",";
+    for (size_t i=0; i<base.size(); ++i)
+    {
+        size_t m = base[i].find("\"median_ms\":");
+        if ((base[i].compare(0, key.size(), key) == 0) &&
+            (base[i].find(run) != std::string::npos) &&
+            (m != std::string::npos))
+        {
+            ms = strtod(base[i].c_str() + m + strlen("\"median_ms\":"), NULL);
+            return(true);
+        }
+    }
+    return(false);
+}
+
+/** Parse a number option
+ * @param[in]  arg Option value
+ * @param[out] n   Value
+ * @return TRUE if arg is a whole decimal number, FALSE otherwise
+ */
+static bool number(const char *arg, unsigned long long &n)
+{
+    char *e;
+    if ((arg[0] < '0') || (arg[0] > '9'))
+        return(false);
+    errno = 0;
+    n = strtoull(arg, &e, 10);
+    return((errno == 0) && (*e == '\0'));
+}
+
+/** Parse a sort algorithm option
+ * @param[in]  arg  Option value
+ * @param[out] mode Sort algorithm
+ * @return TRUE if arg names a sort algorithm, FALSE otherwise
+ */
+static bool sort_mode(const char *arg, e_sortmode &mode)
+{
+    static const char *names[] = { "record", "index", "radix", "parallel" };
+    static const e_sortmode modes[] =
+        { sortmode_RECORD, sortmode_INDEX, sortmode_RADIX, sortmode_PARALLEL };
+    for (size_t i=0; i<sizeof(names)/sizeof(names[0]); ++i)
+        if (strcmp(arg, names[i]) == 0)
+        {
+            mode = modes[i];
+            return(true);
+        }
+    return(false);
+}
+
+/** Application entry point, see the usage at the top of this file
+ * @param[in] argc Number of command line arguments
+ * @param[in] argv Array of command line arguments
+ * @return EXIT_OK if every scenario ran, with no regression when --strict
+ *         is given, EXIT_FAIL otherwise
+ */
+int main(int argc, char **argv)
+{
+    unsigned long long runs = BENCH_RUNS;     /* Timed runs of a scenario */
+    unsigned long long tol = BENCH_TOLERANCE; /* Slowdown reported */
+    const char *basefile = NULL;              /* Baseline to compare with */
+    unsigned long long threads = 1;           /* Threads of each file */
+    e_sortmode mode = sortmode_RADIX;         /* Sort algorithm */
+    s_scenario custom = { "custom", 0, 3, 12, 101, 0, 0, 0 };
+    unsigned long long n;
+    bool strict = false;                      /* Regressions fail the run */
+    bool ok = true;
+
+    for (int i=1; i<argc; ++i)
+    {
+        unsigned int lmin, lmax;
+        char end;
+        if (strcmp(argv[i], "-h") == 0)
+        {
+            printf("%s\n", g_usage);
+            return(EXIT_OK);
+        }
+        else if ((i+1 < argc) && (strcmp(argv[i], "-i") == 0) &&
+            number(argv[i+1], runs) && (runs > 0))
+            ++i;
+        else if ((i+1 < argc) && (strcmp(argv[i], "--tolerance") == 0) &&
+                 number(argv[i+1], tol))
+            ++i;
+        else if ((i+1 < argc) && (strcmp(argv[i], "-b") == 0))
+            basefile = argv[++i];
+        else if (strcmp(argv[i], "--strict") == 0)
+            strict = true;
+        else if ((i+1 < argc) && (strcmp(argv[i], "-t") == 0) &&
+                 number(argv[i+1], threads) && (threads <= UINT_MAX))
+            ++i;
+        else if ((i+1 < argc) && (strcmp(argv[i], "--mode") == 0) &&
+                 sort_mode(argv[i+1], mode))
+            ++i;
+        else if ((i+1 < argc) && (strcmp(argv[i], "-r") == 0) &&
+                 number(argv[i+1], custom.rows) && (custom.rows > 0))
+            ++i;
+        else if ((i+1 < argc) && (strcmp(argv[i], "-l") == 0) &&
+                 (sscanf(argv[i+1], "%u:%u%c", &lmin, &lmax, &end) == 2) &&
+                 (lmin > 0) && (lmin <= lmax))
+        {
+            custom.name_min = lmin;
+            custom.name_max = lmax;
+            ++i;
+        }
+        else if ((i+1 < argc) && (strcmp(argv[i], "-s") == 0) &&
+                 number(argv[i+1], custom.scores) && (custom.scores > 0))
+            ++i;
+        else if ((i+1 < argc) && (strcmp(argv[i], "-d") == 0) &&
+                 number(argv[i+1], n) && (n <= 100))
+        {
+            custom.dups = n;
+            ++i;
+        }
+        else if ((i+1 < argc) && (strcmp(argv[i], "-e") == 0) &&
+                 number(argv[i+1], n) && (n <= 100))
+        {
+            custom.crlf = n;
+            ++i;
+        }
+        else if ((i+1 < argc) && (strcmp(argv[i], "-p") == 0) &&
+                 number(argv[i+1], n) && (n <= UINT_MAX))
+        {
+            custom.pool = n;
+            ++i;
+        }
+        else
+        {
+            print_error(g_usage);
+            return(EXIT_FAIL);
+        }
+    }
+
+    /* Read in the baseline, one line per scenario and phase */
+    std::vector<std::string> base;
+    if (basefile)
+    {
+        std::ifstream in(basefile);
+        std::string line;
+        if (!in)
+        {
+            print_error("Could not read baseline file");
+            return(EXIT_FAIL);
+        }
+        while (std::getline(in, line))
+            base.push_back(line);
+    }
+
+    /* A custom scenario replaces the built in ones */
+    std::vector<s_scenario> scenarios(g_scenarios, g_scenarios +
+                                sizeof(g_scenarios)/sizeof(g_scenarios[0]));
+    if (custom.rows)
+        scenarios.assign(1, custom);
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir)
+        dir = RUN_DIR;
+
+    for (size_t c=0; c<scenarios.size(); ++c)
+    {
+        const s_scenario &sc = scenarios[c];
+        std::string input = std::string(dir) + "/bench-" + sc.name + ".txt";
+        std::string output = std::string(dir) + "/bench-" + sc.name +
+                             FOUT_EXT ".txt";
+        std::vector<double> ms[PHASE_MAX]; /* Times of each phase */
+        double t[PHASE_MAX];
+        if (!generate(input.c_str(), sc))
+        {
+            SYSERR("Could not write benchmark input");
+            return(EXIT_FAIL);
+        }
+        /* The first run brings the file into the page cache, untimed */
+        for (unsigned long long r=0; r<=runs; ++r)
+        {
+            /* Each save writes a new file rather than truncate the last */
+            unlink(output.c_str());
+            if (!run(input.c_str(), output.c_str(), threads, mode, t))
+            {
+                unlink(input.c_str());
+                unlink(output.c_str());
+                return(EXIT_FAIL);
+            }
+            for (unsigned int p=0; (r>0) && (p<PHASE_MAX); ++p)
+                ms[p].push_back(t[p]);
+        }
+        unlink(input.c_str());
+        unlink(output.c_str());
+        for (unsigned int p=0; p<PHASE_MAX; ++p)
+        {
+            double b;
+            std::sort(ms[p].begin(), ms[p].end());
+            double median = percentile(ms[p], 50);
+            printf("{\"case\":\"%s\",\"phase\":\"%s\",\"rows\":%llu,"
+                   "\"runs\":%llu,\"threads\":%u,\"median_ms\":%.3f,"
+                   "\"p99_ms\":%.3f}\n",
+                   sc.name, g_phases[p], sc.rows, runs,
+                   thread_count(threads), median, percentile(ms[p], 99));
+            if (basefile && baseline(base, sc.name, g_phases[p],
+                                         thread_count(threads), b) &&
+                (median > b*(100 + tol)/100))
+            {
+                std::ostringstream msg;
+                msg << "Slower than baseline: " << sc.name << " "
+                    << g_phases[p] << " median " << median << " ms, baseline "
+                    << b << " ms";
+                print_error(msg.str().c_str());
+                ok = !strict && ok;
+            }
+        }
+        fflush(stdout);
+    }
+    return(ok ? EXIT_OK : EXIT_FAIL);
+}
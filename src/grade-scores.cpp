@@ -17,6 +17,9 @@
  * To build and run the unit tests:
  *     make test
  *
+ * To build and run the benchmarks against bench/baseline.txt:
+ *     make bench
+ *
  * To generate doxygen:
  *     make docs
  *
@@ -27,6 +30,36 @@
  *   name followed by first name
  * - Creates a new text file called <input-file-name>-graded.txt with the list of
  *   sorted score and names
+ * - Echoes the sorted list to the console. Use -q to turn the echo off,
+ *   -n rows to limit it to the top rows and -e stderr|file to send it
+ *   elsewhere
+ * - Use -k rows to keep only the top rows while reading, the saved file then
+ *   holds just those and memory no longer grows with the input
+ * - Use -m MiB to sort files larger than memory within that budget, sorted
+ *   runs are spilled to $TMPDIR and merged into the output
+ * - Use -c to keep a binary cache next to the input, later runs on the
+ *   unchanged input load it and skip parsing and sorting. Rows appended to
+ *   the input since are parsed, sorted and merged in on their own
+ * - Discarded rows are reported by line number, at most 10 of them and then
+ *   the total. Use -d lines to show more or fewer, and -r to write the
+ *   discarded rows as they were to <input-file-name>-rejected.txt
+ * - Use --stats, or set GRADE_STATS=1, to report the time spent reading,
+ *   sorting and saving each file and counts of bytes, rows and comparisons
+ *   as one JSON line on stderr. Build with make NOSTATS=1 to leave the
+ *   instrumentation out altogether
+ * - Use --collate to order names the way the locale (LC_ALL, LC_COLLATE
+ *   or LANG) collates them, so accented and non-Latin names sort and fold
+ *   case correctly. Each name is turned into a sort key once as it is read
+ *   and the sort only compares bytes
+ * - Use - as the file name to read standard input in blocks and write the
+ *   sorted list to standard output, nothing else is written there. Files
+ *   graded with it echo and report to standard error
+ * - Takes any number of files, directories (every file in them other than
+ *   graded output) and -l list files naming one input per line. Files are
+ *   graded -j jobs at a time, each reports its own errors and the exit code
+ *   is EXIT_FAIL if any file could not be graded
+ * - Use -t threads to parse and sort each file on that many threads. By
+ *   default the CPUs are shared among the files graded at once
  *
  * @section main-unittest Application: unittest.exe
  * - Test data is available under ./testdata/
@@ -41,24 +74,52 @@
 /* Project C++ library */
 #include "process.h"
 
-/** Application entry point. This application requires exactly one command line
- * parameter which must be a valid text file for sorting.
- * @param[in] argc Number of command line arguments
- * @param[in] argv Array of command line arguments
+/* Global variables */
+/* ---------------- */
+
+static std::mutex g_output;        //!< Keeps the echo of each job whole
+static int g_echo = -1;            //!< Echo file descriptor, opened when used
+static unsigned int g_threads = 1; //!< Threads each file is graded on
+
+/* Macros, Functions and Classes */
+/* ----------------------------- */
+
+/** Grade one input file: read, sort and save it, then echo the sorted
+ * records and report the file created. Standard input is sorted to
+ * standard output instead.
+ * @param[in] job Input file and output file names
  * @return EXIT_OK upon success, EXIT_FAIL otherwise
  */
-int main(int argc, char **argv)
+static int grade(const s_job &job)
 {
     CSimpleCSV csv; /* CSV file processor, composite class */
 
-    /* Validate the command line input and populate output filename g_ofname */
-    if (!validate_arg(argc, argv))
+    /* Read in the data, keeping only the best records or spilling sorted
+     * runs to temporary files if asked to */
+    csv.topk(g_opts.keep);
+    csv.budget(g_opts.budget);
+    csv.cache(g_opts.cache);
+    csv.discards(g_opts.show);
+    csv.collate(g_opts.collate);
+    csv.threads(g_threads);
+    int rejects = -1; /* Discarded rows file */
+    if (g_opts.rejects)
+    {
+        rejects = ::open(job.rfname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+        if (rejects < 0)
+        {
+            SYSERR("Could not write discarded rows file");
+            return(EXIT_FAIL);
+        }
+        csv.rejected(rejects);
+    }
+    e_rwcode rc = csv.read(job.src.c_str());
+    if ((rejects >= 0) && (::close(rejects) != 0))
     {
+        SYSERR("Could not write discarded rows file");
         return(EXIT_FAIL);
     }
-
-    /* Read in the data */
-    if (csv.read(SRC)==rwcode_FAIL)
+    if (rc==rwcode_FAIL)
     {
         return(EXIT_FAIL);
     }
@@ -70,20 +131,114 @@ int main(int argc, char **argv)
         return(EXIT_FAIL);
     }
 
-    /* Sort the data */
+    /* Sort the data, unless the cache had it sorted already */
     csv.sort();
 
+    /* Keep the parsed and sorted data for the next run, a failure here is
+     * reported but the grading itself can still go ahead */
+    if (g_opts.cache)
+        csv.save_cache();
+
+    /* Standard input is graded to standard output, with no echo or message
+     * so the output can be piped on. In top-K mode the kept records are
+     * written as soon as the input ends. */
+    if (job.src == "-")
+    {
+        std::lock_guard<std::mutex> lock(g_output);
+        if (!csv.print(ULLONG_MAX, STDOUT_FILENO))
+        {
+            print_error("Could not write output file");
+            return(EXIT_FAIL);
+        }
+        if (g_opts.stats)
+            print_stats(job.src.c_str(), csv.stats());
+        return(EXIT_OK);
+    }
+
     /* Save the data post sorting, we use the full path */
-    if (csv.save(g_ofname)==rwcode_FAIL)
+    if (csv.save(job.ofname)==rwcode_FAIL)
     {
         return(EXIT_FAIL);
     }
 
-    /* Print the data post sorting */
-    csv.print();
+    /* Echo the data post sorting, unless asked to be quiet. Jobs finishing
+     * together take turns so each echo comes out whole. */
+    std::lock_guard<std::mutex> lock(g_output);
+    if (!g_opts.quiet)
+    {
+        if (g_echo < 0)
+        {
+            if (strcmp(g_opts.echo, "stdout") == 0)
+                g_echo = STDOUT_FILENO;
+            else if (strcmp(g_opts.echo, "stderr") == 0)
+                g_echo = STDERR_FILENO;
+            else
+                g_echo = ::open(g_opts.echo, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+        }
+        if ((g_echo < 0) || !csv.print(g_opts.top, g_echo))
+        {
+            print_error("Could not write output file");
+            return(EXIT_FAIL);
+        }
+    }
 
     /* Show the required completed message
      * Specification shows leading path has been removed so we do the same */
-    std::cout << "Finished: created " << (g_ofname+g_ofshort) << std::endl;
+    (g_opts.piped?std::cerr:std::cout) << "Finished: created "
+                                       << (job.ofname+job.ofshort) << std::endl;
+    if (g_opts.stats)
+        print_stats(job.src.c_str(), csv.stats());
     return(EXIT_OK);
 }
+
+/** Application entry point. This application requires at least one input
+ * file, directory or list of files on the command line, optionally preceded
+ * or followed by options (see validate_arg()). Several files are graded at
+ * once on a bounded pool of threads.
+ * @param[in] argc Number of command line arguments
+ * @param[in] argv Array of command line arguments
+ * @return EXIT_OK if every file was graded, EXIT_FAIL otherwise
+ */
+int main(int argc, char **argv)
+{
+    /* Validate the command line input and populate the jobs in g_jobs */
+    if (!validate_arg(argc, argv))
+    {
+        return(EXIT_FAIL);
+    }
+
+    /* Names are collated as LC_ALL, LC_COLLATE or LANG say, a locale which
+     * collates bytewise gets the usual case folding instead */
+    if (g_opts.collate &&
+        (!setlocale(LC_COLLATE, "") || bytewise_collation()))
+    {
+        print_error("The locale collates bytewise, names are folded to lower "
+                    "case instead");
+        g_opts.collate = false;
+    }
+
+    /* Grade every file, messages of each are prefixed with its name when
+     * there are several. The files graded at once share the CPUs. */
+    std::vector<int> result(g_jobs.size());
+    bool batch = (g_jobs.size() + g_failed) > 1;
+    g_threads = job_threads(batch?g_jobs.size():1);
+    parallel_for(g_jobs.size(), batch?g_opts.jobs:1, [&](size_t i)
+    {
+        if (batch)
+            error_context(g_jobs[i].src.c_str());
+        result[i] = grade(g_jobs[i]);
+        error_context(NULL);
+    });
+
+    /* Any file which could not be graded fails the whole run */
+    int r = (g_failed == 0)?EXIT_OK:EXIT_FAIL;
+    for (size_t i=0; i<result.size(); ++i)
+        if (result[i] != EXIT_OK)
+            r = EXIT_FAIL;
+    if ((g_echo > STDERR_FILENO) && (::close(g_echo) != 0))
+    {
+        print_error("Could not write output file");
+        r = EXIT_FAIL;
+    }
+    return(r);
+}
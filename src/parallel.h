@@ -0,0 +1,107 @@
+/* Copyright messages and all buisness related headers go here
+ */
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+/* Standard C++ library */
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/* Macros, Functions and Classes */
+/* ----------------------------- */
+
+/** Number of worker threads to use for a requested thread count
+ * @param[in] threads Requested number of threads, 0 for one per CPU
+ * @return Number of threads to use, at least 1
+ */
+inline unsigned int thread_count(unsigned int threads)
+{
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    return((threads == 0)?1:threads);
+}
+
+/** Run tasks 0 to n-1 on a bounded pool of worker threads. Each worker takes
+ * the next task number as it becomes free, the calling thread is one of the
+ * workers and the call returns once every task has completed.
+ * @param[in] n       Number of tasks
+ * @param[in] threads Maximum number of threads, 0 for one per CPU
+ * @param[in] task    Callable invoked with each task number
+ */
+template <typename F>
+void parallel_for(size_t n, unsigned int threads, F task)
+{
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+    threads = (unsigned int)std::min<size_t>(thread_count(threads), n);
+    auto worker = [&]()
+    {
+        for (size_t i=next++; i<n; i=next++)
+            task(i);
+    };
+    for (unsigned int t=1; t<threads; ++t)
+        pool.push_back(std::thread(worker));
+    worker();
+    for (size_t t=0; t<pool.size(); ++t)
+        pool[t].join();
+}
+
+/** Sort a vector on several threads. The vector is cut into one slice per
+ * thread, the slices are sorted concurrently and then merged pairwise, each
+ * round of merges again running concurrently. For a comparison which is a
+ * total order the result is identical to std::sort.
+ * @param[in,out] v       Vector to sort
+ * @param[in]     threads Maximum number of threads, 0 for one per CPU
+ * @param[in]     less    Strict weak ordering of the elements
+ */
+template <typename T, typename C>
+void parallel_sort(std::vector<T> &v, unsigned int threads, C less)
+{
+    size_t parts = std::min<size_t>(thread_count(threads), v.size());
+    if (parts <= 1)
+    {
+        std::sort(v.begin(), v.end(), less);
+        return;
+    }
+    /* Slice boundaries, slice i is [bound[i], bound[i+1]) */
+    std::vector<size_t> bound(parts+1);
+    for (size_t i=0; i<=parts; ++i)
+        bound[i] = v.size() * i / parts;
+    parallel_for(parts, threads, [&](size_t i)
+    {
+        std::sort(v.begin()+bound[i], v.begin()+bound[i+1], less);
+    });
+    /* Merge neighbouring slices until one remains */
+    std::vector<T> tmp(v.size());
+    std::vector<T> *src = &v;
+    std::vector<T> *dst = &tmp;
+    while (bound.size() > 2)
+    {
+        size_t pairs = (bound.size()-1)/2;
+        parallel_for((bound.size())/2, threads, [&](size_t i)
+        {
+            typename std::vector<T>::iterator b = src->begin();
+            if (i < pairs)
+                std::merge(b+bound[2*i], b+bound[2*i+1],
+                           b+bound[2*i+1], b+bound[2*i+2],
+                           dst->begin()+bound[2*i], less);
+            else
+                /* Odd slice out, carried over to the next round */
+                std::copy(b+bound[2*i], b+bound[2*i+1],
+                          dst->begin()+bound[2*i]);
+        });
+        std::vector<size_t> merged;
+        for (size_t i=0; i<bound.size(); i+=2)
+            merged.push_back(bound[i]);
+        if (merged.back() != bound.back())
+            merged.push_back(bound.back());
+        bound.swap(merged);
+        std::swap(src, dst);
+    }
+    if (src != &v)
+        v.swap(*src);
+}
+
+#endif
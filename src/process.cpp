@@ -17,6 +17,60 @@
 /* Structures */
 /* ---------- */
 
+#ifndef NOSTATS
+/** Comparisons made on one thread, added to g_compares as the thread ends */
+struct s_tally
+{
+    unsigned long long n; //!< Comparisons so far
+
+    /** Destructor, hands the count over at thread exit */
+    ~s_tally();
+};
+
+static std::atomic<unsigned long long> g_compares; //!< Of finished threads
+static thread_local s_tally t_compares; //!< Of the current thread
+
+s_tally::~s_tally()
+{
+    g_compares += n;
+}
+#endif
+
+/** Three way comparison of two records on their score and names. The packed
+ * keys settle most comparisons, the lower case names are only compared
+ * beyond the packed prefix when the prefixes tie.
+ * @param[in] r1 First record
+ * @param[in] r2 Second record
+ * @return Negative if r1 orders first, positive if r2 orders first, zero if
+ *         they are equal
+ */
+static inline int record_cmp(const s_record &r1, const s_record &r2)
+{
+#ifndef NOSTATS
+    ++t_compares.n;
+#endif
+    const s_sortkey &k1 = r1.key;
+    const s_sortkey &k2 = r2.key;
+    if (k1.score != k2.score)
+        return((k1.score < k2.score)?-1:1);
+    /* Scores are equal, order by last then first name */
+    if (k1.last != k2.last)
+        return((k1.last < k2.last)?-1:1);
+    if (k1.last & 0xff)
+    {
+        /* Prefixes tie and neither name ends within them */
+        int c = strcmp(r1.llast+KEY_PREFIX, r2.llast+KEY_PREFIX);
+        if (c != 0)
+            return(c);
+    }
+    /* Last names are equal, order by first name */
+    if (k1.first != k2.first)
+        return((k1.first < k2.first)?-1:1);
+    if (k1.first & 0xff)
+        return(strcmp(r1.lfirst+KEY_PREFIX, r2.lfirst+KEY_PREFIX));
+    return(0);
+}
+
 /** Orders the names by their score. If scores are the same, order by their
  * last name followed by first name
  */
@@ -30,239 +84,2267 @@ struct s_record_order
      * @return TRUE for r1 to be ordered before r2, FALSE for r2 to be ordered
      *         before r1.
      */
-    inline bool operator() (const s_record &r1, const s_record &r2)
+    inline bool operator() (const s_record &r1, const s_record &r2) const
+    {
+        return(record_cmp(r1, r2) < 0);
+    }
+} o_record_order;
+
+/** Same ordering as s_record_order applied to key/index pairs. Records which
+ * compare equal keep their relative input order. Pairs packed with ranked
+ * names are ordered by their integers alone, others go back to the records
+ * they stand in for when their keys tie.
+ */
+struct s_sortref_order
+{
+    const s_record *records; //!< Records of the pairs, NULL if ranked
+
+    /** Constructor
+     * @param[in] r Records the pairs index, NULL if the pairs are packed
+     *              with ranked names and never need them
+     */
+    s_sortref_order(const s_record *r) : records(r) {}
+
+    /** Comparison operator for s_sortref, see s_record_order
+     * @param[in] r1 First reference to be compared
+     * @param[in] r2 Second reference to be compared
+     * @return TRUE for r1 to be ordered before r2, FALSE otherwise
+     */
+    inline bool operator() (const s_sortref &r1, const s_sortref &r2) const
     {
-        if (r1.score == r2.score)
+        if ((r1.key != r2.key) || !records)
         {
-            /* Scores are equal, order by last then first name */
-            int c = strcmp(r1.llast.data(), r2.llast.data());
-            if (c == 0)
-            {
-                /* Last names are equal, order by first name */
-                return(strcmp(r1.lfirst.data(), r2.lfirst.data()) < 0);
-            }
-            return(c < 0);
+#ifndef NOSTATS
+            ++t_compares.n;
+#endif
+            return((r1.key < r2.key) ||
+                   ((r1.key == r2.key) && (r1.tie < r2.tie)));
         }
-        return(r1.score > r2.score);
+        int c = record_cmp(records[r1.index()], records[r2.index()]);
+        return((c < 0) || ((c == 0) && (r1.tie < r2.tie)));
     }
-} o_record_order;
+};
+
+/** Same ordering as s_sortref_order applied to top-K heap entries, records
+ * which compare equal order by the line they were read from
+ */
+struct s_topk_order
+{
+    /** Comparison operator for s_topk, see s_record_order
+     * @param[in] t1 First entry to be compared
+     * @param[in] t2 Second entry to be compared
+     * @return TRUE for t1 to be ordered before t2, FALSE otherwise
+     */
+    inline bool operator() (const s_topk &t1, const s_topk &t2) const
+    {
+        int c = record_cmp(t1.rec, t2.rec);
+        return((c < 0) || ((c == 0) && (t1.line < t2.line)));
+    }
+} o_topk_order;
+
 
 /* Global variables */
 /* ---------------- */
 
-char g_ofname[PATH_MAX]; //!< Output file name
-size_t g_ofshort;        //!< Offset into g_ofname for filename less path
+s_options g_opts;          //!< Command line options
+std::vector<s_job> g_jobs; //!< Input files to be graded
+unsigned int g_failed;     //!< Input files rejected before grading
+
+static std::mutex g_console;               //!< Serialises error messages
+static thread_local const char *t_context; //!< Job of the current thread
 
 /* Macros, Functions and Classes */
 /* ----------------------------- */
 
 void print_error(const char *message)
 {
-    std::cerr << message << std::endl;
+    std::string text; /* Every line of the message, prefixed by the job */
+    const char *p = message;
+    do
+    {
+        const char *e = strchr(p, '\n');
+        if (e == NULL)
+            e = p + strlen(p);
+        if (t_context)
+            text.append(t_context).append(": ");
+        text.append(p, e).append(1, '\n');
+        p = (*e)?(e + 1):e;
+    } while (*p);
+    /* One write for the lot, so lines of other jobs cannot come between */
+    std::lock_guard<std::mutex> lock(g_console);
+    std::cerr << text;
 }
 
 void print_error(const char *f, int l, int e, const char *message)
 {
+    std::lock_guard<std::mutex> lock(g_console);
+    if (t_context)
+        fprintf(stderr, "%s: ", t_context);
     fprintf(stderr, "%s:%d %s (%d:%s)\n", f, l, (message)?message:"error:", e,
            strerror(e));
 }
 
-bool validate_arg(const int argc, char **argv)
+void print_stats(const char *name, const s_stats &stats)
 {
-    size_t l;        /* Length of source filename */
-    size_t ld;       /* Leading path and dots in the filename */
-    char fname[PATH_MAX]; /* File name pre dot */
-    char fext[PATH_MAX];  /* File name post dot */
+    std::ostringstream msg;
+    msg << "{\"file\":\"";
+    for (const char *p=name; *p; ++p)
+    {
+        if ((*p == '"') || (*p == '\\'))
+            msg << '\\' << *p;
+        else if ((unsigned char)*p < ' ')
+        {
+            char u[8];
+            snprintf(u, sizeof(u), "\\u%04x", (unsigned char)*p);
+            msg << u;
+        }
+        else
+            msg << *p;
+    }
+    msg << "\",\"read_ns\":" << stats.read_ns
+        << ",\"sort_ns\":" << stats.sort_ns
+        << ",\"save_ns\":" << stats.save_ns
+        << ",\"bytes_read\":" << stats.bytes_read
+        << ",\"rows_accepted\":" << stats.rows_accepted
+        << ",\"rows_discarded\":" << stats.rows_discarded
+        << ",\"comparisons\":" << stats.comparisons
+        << ",\"bytes_written\":" << stats.bytes_written << "}";
+    std::lock_guard<std::mutex> lock(g_console);
+    std::cerr << msg.str() << std::endl;
+}
 
-    /* Initialist the destination path global and local variables */
-    g_ofname[0] = '\0';
-    fname[0] = '\0';
-    fext[0] = '\0';
-    /* Make sure we only have one command line parameter */
-    if (argc > (MAX_ARGS+1))
+#ifndef NOSTATS
+/** Comparisons made so far by finished threads and the current thread
+ * @return Number of comparisons
+ */
+static unsigned long long compare_count()
+{
+    return(g_compares + t_compares.n);
+}
+
+CStatsTimer::CStatsTimer(unsigned long long &ns, unsigned long long &compares) :
+    m_ns(ns), m_compares(compares), m_start(std::chrono::steady_clock::now()),
+    m_base(compare_count())
+{
+}
+
+CStatsTimer::~CStatsTimer()
+{
+    m_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - m_start).count();
+    m_compares += compare_count() - m_base;
+}
+#endif
+
+void error_context(const char *name)
+{
+    t_context = name;
+}
+
+uint64_t content_hash(const char *p, size_t n)
+{
+    const uint64_t m = 0x9e3779b97f4a7c15ULL; /* Odd multiplier */
+    uint64_t h = n * m;
+    uint64_t w;
+    for (; n >= sizeof(w); p += sizeof(w), n -= sizeof(w))
+    {
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * m;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, p, n);
+    h = (h ^ w) * m;
+    return(h ^ (h >> 29));
+}
+
+/** Check 8 characters, loaded little endian, are all decimal digits
+ * @param[in] w Characters, the first in the lowest byte
+ * @return TRUE if every character is '0' to '9'
+ */
+static inline bool eight_digits(uint64_t w)
+{
+    return(((w & 0xf0f0f0f0f0f0f0f0ULL) |
+            (((w + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4)) ==
+           0x3333333333333333ULL);
+}
+
+/** Value of 8 decimal digits, loaded little endian, in three multiplies
+ * rather than eight: neighbouring digits are combined in pairs, then pairs
+ * of pairs, then the two halves.
+ * @param[in] w Digits, the first and most significant in the lowest byte
+ * @return Value of the digits, 0 to 99999999
+ */
+static inline uint32_t eight_digit_value(uint64_t w)
+{
+    w -= 0x3030303030303030ULL;
+    w = (w * 10) + (w >> 8);
+    w = (((w & 0x000000ff000000ffULL) * 0x000f424000000064ULL) +
+         (((w >> 16) & 0x000000ff000000ffULL) * 0x0000271000000001ULL)) >> 32;
+    return((uint32_t)w);
+}
+
+bool parse_score(const char *b, const char *e, unsigned long long &v)
+{
+    static const char max[] = "18446744073709551615"; /* ULLONG_MAX */
+    unsigned long long r = 0;
+    size_t n = e - b;
+    if (n == 0)
+        return(false);
+    /* Leading zeros do not count towards the digits which fit */
+    for (; (n > 1) && (*b == '0'); ++b, --n);
+    if ((n > sizeof(max)-1) ||
+        ((n == sizeof(max)-1) && (memcmp(b, max, n) > 0)))
+        return(false);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    /* Long scores eight digits at a time, never reading past the field */
+    for (; n >= 8; b += 8, n -= 8)
+    {
+        uint64_t w;
+        memcpy(&w, b, sizeof(w));
+        if (!eight_digits(w))
+            return(false);
+        r = r*100000000 + eight_digit_value(w);
+    }
+#endif
+    for (; n; ++b, --n)
+    {
+        unsigned int d = (unsigned char)*b - '0';
+        if (d > 9)
+            return(false);
+        r = r*10 + d;
+    }
+    v = r;
+    return(true);
+}
+
+/** Fold the ASCII upper case letters of 8 characters to lower case. Each
+ * character is tested within its own byte, so no carry crosses between them.
+ * @param[in] w Characters
+ * @return Characters with 'A' to 'Z' changed to 'a' to 'z'
+ */
+static inline uint64_t eight_lower(uint64_t w)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t low = w & (0x7f*ones);             /* Top bit cleared */
+    uint64_t ge_a = low + (0x80 - 'A')*ones;     /* Top bit set from 'A' */
+    uint64_t gt_z = low + (0x80 - 'Z' - 1)*ones; /* Top bit set beyond 'Z' */
+    uint64_t upper = (ge_a ^ gt_z) & ~w & (0x80*ones);
+    return(w | (upper >> 2));
+}
+
+char *fold_lower(char *d, const char *b, const char *e, char *o)
+{
+    size_t n = e - b;
+    for (; n >= 8; b += 8, d += 8, n -= 8)
+    {
+        uint64_t w;
+        memcpy(&w, b, sizeof(w));
+        if (o)
+        {
+            memcpy(o, &w, sizeof(w));
+            o += 8;
+        }
+        w = eight_lower(w);
+        memcpy(d, &w, sizeof(w));
+    }
+    for (; n; ++b, ++d, --n)
+    {
+        unsigned char c = *b;
+        if (o)
+            *o++ = c;
+        *d = c + (((unsigned char)(c - 'A') < 26) ? ('a' - 'A') : 0);
+    }
+    return(d);
+}
+
+bool bytewise_collation()
+{
+    const char *name = setlocale(LC_COLLATE, NULL); /* Current locale */
+    return(!name || (strcmp(name, "C") == 0) || (strcmp(name, "POSIX") == 0) ||
+           (strncmp(name, "C.", 2) == 0));
+}
+
+/** Append the collation key of a name in the current locale to a string
+ * @param[in,out] k Collation key appended here, NUL terminated
+ * @param[in]     b First character of the name
+ * @param[in]     e One past the last character of the name
+ * @return Length of the key, without its NUL
+ */
+static size_t collate_name(std::string &k, const char *b, const char *e)
+{
+    static thread_local std::string name; /* The name, NUL terminated */
+    name.assign(b, e);
+    size_t at = k.size();
+    /* Keys are usually a few times longer than the name, retry if not */
+    k.resize(at + 4*name.size() + 1);
+    size_t n = strxfrm(&k[at], name.c_str(), k.size() - at);
+    if (n >= k.size() - at)
+    {
+        k.resize(at + n + 1);
+        strxfrm(&k[at], name.c_str(), n + 1);
+    }
+    k.resize(at + n + 1);
+    return(n);
+}
+
+/** Collation keys of both names of a record, back to back and NUL
+ * terminated like the lower case names they stand in for
+ * @param[out] k Collation keys of the last then first name
+ * @param[in]  l Last name
+ * @param[in]  f First name
+ * @return Length of the key of the last name
+ */
+static size_t collate_keys(std::string &k, const s_column &l,
+                           const s_column &f)
+{
+    k.clear();
+    size_t n = collate_name(k, l.b, l.e);
+    collate_name(k, f.b, f.e);
+    return(n);
+}
+
+/** Sort keys of both names of a record, back to back and NUL terminated:
+ * the names in lower case, or their collation keys
+ * @param[out] k       Keys of the last then first name
+ * @param[in]  l       Last name
+ * @param[in]  f       First name
+ * @param[in]  collate Collation keys rather than lower case names
+ * @param[out] o       Where the names are also copied back to back, NULL
+ *                     for nowhere
+ * @return Length of the key of the last name
+ */
+static size_t name_keys(std::string &k, const s_column &l, const s_column &f,
+                        bool collate, char *o)
+{
+    if (collate)
+    {
+        if (o)
+        {
+            memcpy(o, l.b, l.size());
+            memcpy(o + l.size(), f.b, f.size());
+        }
+        return(collate_keys(k, l, f));
+    }
+    /* Copying and lowering the names is one pass over them */
+    k.resize(l.size() + f.size() + 2);
+    char *d = fold_lower(&k[0], l.b, l.e, o);
+    *d++ = '\0';
+    d = fold_lower(d, f.b, f.e, o?(o + l.size()):NULL);
+    *d = '\0';
+    return(l.size());
+}
+
+/** Convert the value of a numeric option
+ * @param[in]  arg Option value from the command line
+ * @param[out] v   Value converted
+ * @return TRUE if arg is a whole non negative number, FALSE otherwise
+ */
+static bool option_count(const char *arg, unsigned long long &v)
+{
+    char *end;       /* End of the numeric value */
+    errno = 0;
+    v = strtoull(arg, &end, 10);
+    return((errno == 0) && (*end == '\0') && (end != arg) && (arg[0] != '-'));
+}
+
+/** Whether a file name is one make_job() derives from an input, that is the
+ * part before its extension ends in the given suffix
+ * @param[in] name File name, without its path
+ * @param[in] ext  Suffix added by make_job(), #FOUT_EXT or #FREJECT_EXT
+ * @return TRUE if the name ends its stem in ext, FALSE otherwise
+ */
+static bool derived_name(const char *name, const char *ext)
+{
+    const char *b = name + strspn(name, "."); /* Stem after leading dots */
+    size_t n = strcspn(b, ".");               /* Length of the stem */
+    size_t l = strlen(ext);
+    return((n >= l) && (memcmp(b + n - l, ext, l) == 0));
+}
+
+/** Add an input named on the command line. A directory adds every regular
+ * file in it, in name order, except graded output and caches.
+ * @param[in]     name  File or directory name
+ * @param[in,out] names Input files, added to
+ * @return TRUE unless the directory could not be read
+ */
+static bool add_input(const char *name, std::vector<std::string> &names)
+{
+    struct stat st;  /* Type of the input */
+    DIR *d;          /* Directory being listed */
+    struct dirent *e;
+    if ((stat(name, &st) != 0) || !S_ISDIR(st.st_mode))
+    {
+        /* Not a directory, make_job() reports anything else wrong */
+        names.push_back(name);
+        return(true);
+    }
+    if ((d = opendir(name)) == NULL)
     {
-        print_error("This application only accepts one command line parameter");
+        SYSERR("Could not read directory");
         return(false);
     }
-    if (argc < (MAX_ARGS+1))
+    std::vector<std::string> dir; /* Files of the directory */
+    while ((e = readdir(d)) != NULL)
+    {
+        std::string path = std::string(name) + "/" + e->d_name;
+        size_t n = strlen(e->d_name);
+        size_t c = strlen(FCACHE_EXT);
+        if ((stat(path.c_str(), &st) != 0) || !S_ISREG(st.st_mode) ||
+            derived_name(e->d_name, FOUT_EXT) ||
+            derived_name(e->d_name, FREJECT_EXT) ||
+            ((n > c) && (strcmp(e->d_name + n - c, FCACHE_EXT) == 0)) ||
+            strstr(e->d_name, FCACHE_EXT ".tmp"))
+            continue;
+        dir.push_back(path);
+    }
+    closedir(d);
+    std::sort(dir.begin(), dir.end());
+    names.insert(names.end(), dir.begin(), dir.end());
+    return(true);
+}
+
+/** Add the inputs named in a list file, one per line
+ * @param[in]     list  List file name
+ * @param[in,out] names Input files, added to
+ * @return TRUE unless the list could not be read
+ */
+static bool add_list(const char *list, std::vector<std::string> &names)
+{
+    std::ifstream in(list);
+    std::string line;
+    bool r = true;
+    if (!in)
     {
-        print_error("This application requires one command line parameter");
+        SYSERR("Could not read list file");
         return(false);
     }
+    while (std::getline(in, line))
+    {
+        /* Lists written on other platforms end their lines in \r\n */
+        if (!line.empty() && (line[line.size()-1] == '\r'))
+            line.erase(line.size()-1);
+        if (!line.empty())
+            r = add_input(line.c_str(), names) && r;
+    }
+    return(r);
+}
+
+bool make_job(const char *src, s_job &job)
+{
+    size_t l;        /* Length of source filename */
+    size_t ld;       /* Leading path and dots in the filename */
+    char fname[PATH_MAX]; /* File name pre dot */
+    char fext[PATH_MAX];  /* File name post dot */
+
+    /* Initialist the destination path and local variables */
+    job.src = src;
+    job.ofname[0] = '\0';
+    job.rfname[0] = '\0';
+    job.ofshort = 0;
+    fname[0] = '\0';
+    fext[0] = '\0';
     /* Make sure the filename parameter does not exceed system limits */
-    l = strlen(SRC);
+    l = strlen(src);
     if (l == 0)
     {
         print_error("Source file name is required");
         return(false);
     }
+    /* Standard input is graded to standard output */
+    if (strcmp(src, "-") == 0)
+    {
+        strcpy(job.ofname, "-");
+        strcpy(job.rfname, FREJECT_STDIN FREJECT_EXT ".txt");
+        return(true);
+    }
     if (l >= PATH_MAX-1)
     {
         print_error("Source file name length exceeds system limits");
         return(false);
     }
-    if (l + strlen(FOUT_EXT) >= PATH_MAX-1)
+    if (l + std::max(strlen(FOUT_EXT), strlen(FREJECT_EXT)) >= PATH_MAX-1)
     {
         print_error("Destination file name length exceeds system limits");
         return(false);
     }
     /* Make sure the file exists and is readable */
-    if (access(SRC, R_OK)!=0)
+    if (access(src, R_OK)!=0)
     {
         SYSERR("File access error");
         return(false);
     }
     /* The path might have '/' or '\' so break out the path and filename
      * for separate processing */
-    std::string src(SRC);
-    ld = src.find_last_of("/\\");
+    ld = job.src.find_last_of("/\\");
     if (ld == std::string::npos)
         ld = 0;
     else
     {
         ++ld;
-        strncpy(g_ofname, SRC, ld);
-        g_ofname[ld]='\0';
+        strncpy(job.ofname, src, ld);
+        job.ofname[ld]='\0';
     }
-    g_ofshort = ld;
-    /* Count any leading dots in filename and append dots to g_ofname */
-    for (; (ld < l) && (SRC[ld]=='.'); ++ld) strcat(g_ofname,".");
+    job.ofshort = ld;
+    /* Count any leading dots in filename and append dots to ofname */
+    for (; (ld < l) && (src[ld]=='.'); ++ld) strcat(job.ofname,".");
     /* Break the filename into its components */
-    sscanf(SRC+ld, "%[^.].%s", fname, fext);
-    /* Build the destination file name */
-    strcat(g_ofname, fname);
-    strcat(g_ofname, FOUT_EXT);
+    sscanf(src+ld, "%[^.].%s", fname, fext);
+    /* Build the destination file names */
+    strcat(job.ofname, fname);
+    strcpy(job.rfname, job.ofname);
+    strcat(job.ofname, FOUT_EXT);
+    strcat(job.rfname, FREJECT_EXT);
     if (strlen(fext))
     {
-        strcat(g_ofname, ".");
-        strcat(g_ofname,  fext);
+        strcat(job.ofname, ".");
+        strcat(job.ofname,  fext);
+        strcat(job.rfname, ".");
+        strcat(job.rfname,  fext);
     }
     return(true);
 }
 
-std::string CSimpleCSV::trim(const std::string &str)
+bool validate_arg(const int argc, char **argv)
+{
+    std::vector<std::string> names; /* Input files to be graded */
+    unsigned long long jobs;        /* Value of the -j or -t option */
+
+    /* Initialise the jobs and options */
+    g_jobs.clear();
+    g_failed = 0;
+    g_opts.quiet = false;
+    g_opts.top = ULLONG_MAX;
+    g_opts.keep = 0;
+    g_opts.budget = 0;
+    g_opts.cache = false;
+    g_opts.echo = "stdout";
+    g_opts.jobs = 0;
+    g_opts.threads = 0;
+    g_opts.show = DISCARD_SHOW;
+    g_opts.rejects = false;
+    g_opts.collate = false;
+    g_opts.piped = false;
+    const char *env = getenv(STATS_ENV);
+#ifdef NOSTATS
+    (void)env;
+    g_opts.stats = false;
+#else
+    g_opts.stats = env && *env && (strcmp(env, "0") != 0);
+#endif
+    /* Separate the options from the file names */
+    for (int i=1; i<argc; ++i)
+    {
+        if ((argv[i][0] != '-') || (argv[i][1] == '\0'))
+        {
+            if (!add_input(argv[i], names))
+                ++g_failed;
+        }
+        else if (strcmp(argv[i], "-q") == 0)
+            g_opts.quiet = true;
+        else if (strcmp(argv[i], "-c") == 0)
+            g_opts.cache = true;
+        else if (strcmp(argv[i], "-r") == 0)
+            g_opts.rejects = true;
+        else if ((strcmp(argv[i], "-d") == 0) && (i+1 < argc))
+        {
+            if (!option_count(argv[++i], g_opts.show))
+            {
+                print_error("Option -d requires a number of lines");
+                return(false);
+            }
+        }
+        else if (strcmp(argv[i], "--collate") == 0)
+            g_opts.collate = true;
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+#ifdef NOSTATS
+            print_error("Statistics are not available in this build");
+#else
+            g_opts.stats = true;
+#endif
+        }
+        else if ((strcmp(argv[i], "-n") == 0) && (i+1 < argc))
+        {
+            if (!option_count(argv[++i], g_opts.top))
+            {
+                print_error("Option -n requires a number of rows");
+                return(false);
+            }
+        }
+        else if ((strcmp(argv[i], "-k") == 0) && (i+1 < argc))
+        {
+            if (!option_count(argv[++i], g_opts.keep))
+            {
+                print_error("Option -k requires a number of rows");
+                return(false);
+            }
+        }
+        else if ((strcmp(argv[i], "-m") == 0) && (i+1 < argc))
+        {
+            unsigned long long mib;
+            if (!option_count(argv[++i], mib) || (mib > (SIZE_MAX >> 20)))
+            {
+                print_error("Option -m requires a size in MiB");
+                return(false);
+            }
+            g_opts.budget = mib << 20;
+        }
+        else if ((strcmp(argv[i], "-j") == 0) && (i+1 < argc))
+        {
+            if (!option_count(argv[++i], jobs) || (jobs > UINT_MAX))
+            {
+                print_error("Option -j requires a number of files");
+                return(false);
+            }
+            g_opts.jobs = jobs;
+        }
+        else if ((strcmp(argv[i], "-t") == 0) && (i+1 < argc))
+        {
+            if (!option_count(argv[++i], jobs) || (jobs > UINT_MAX))
+            {
+                print_error("Option -t requires a number of threads");
+                return(false);
+            }
+            g_opts.threads = jobs;
+        }
+        else if ((strcmp(argv[i], "-l") == 0) && (i+1 < argc))
+        {
+            if (!add_list(argv[++i], names))
+                ++g_failed;
+        }
+        else if ((strcmp(argv[i], "-e") == 0) && (i+1 < argc))
+            g_opts.echo = argv[++i];
+        else
+        {
+            print_error("Usage: grade-scores.exe [-q] [-c] [-r] [--stats] "
+                        "[--collate] "
+                        "[-n rows] [-k rows] [-m MiB] [-d lines] "
+                        "[-e stdout|stderr|file] [-j jobs] [-t threads] "
+                        "[-l list] file|directory|- ...");
+            return(false);
+        }
+    }
+    /* Make sure we have something to grade */
+    if (names.empty() && (g_failed == 0))
+    {
+        print_error("This application requires a file, directory or list");
+        return(false);
+    }
+    /* A file named twice, or also through a directory or list, is graded
+     * once, two jobs would write the same output at the same time */
+    std::set<std::pair<dev_t, ino_t> > files; /* Identity of the files */
+    std::set<std::string> others;             /* Names which are not files */
+    size_t n = 0;
+    for (size_t i=0; i<names.size(); ++i)
+    {
+        struct stat st;
+        bool first = ((names[i] != "-") && (stat(names[i].c_str(), &st) == 0))?
+                     files.insert(std::make_pair(st.st_dev, st.st_ino)).second:
+                     others.insert(names[i]).second;
+        if (first)
+            names[n++] = names[i];
+    }
+    names.resize(n);
+    /* Each file reports its own problems, the others are still graded */
+    g_jobs.resize(names.size());
+    n = 0;
+    for (size_t i=0; i<names.size(); ++i)
+    {
+        if (names.size() > 1)
+            error_context(names[i].c_str());
+        if (make_job(names[i].c_str(), g_jobs[n]))
+            ++n;
+        else
+            ++g_failed;
+        error_context(NULL);
+    }
+    g_jobs.resize(n);
+    /* Standard output is left to the sorted standard input alone */
+    for (size_t i=0; (i<g_jobs.size()) && (g_jobs.size()>1); ++i)
+        if (g_jobs[i].src == "-")
+            g_opts.piped = true;
+    if (g_opts.piped && (strcmp(g_opts.echo, "stdout") == 0))
+        g_opts.echo = "stderr";
+    return(!g_jobs.empty());
+}
+
+unsigned int job_threads(size_t files)
 {
-    size_t first = str.find_first_not_of(" \r\n");
-    if (first == std::string::npos)
-        return "";
-    size_t last = str.find_last_not_of(" \r\n");
-    return str.substr(first, (last-first+1));
+    if (g_opts.threads)
+        return(g_opts.threads);
+    size_t at_once = std::min<size_t>(thread_count(g_opts.jobs), files);
+    return(std::max<unsigned int>(1, thread_count(0)/std::max<size_t>(1,
+                                                                  at_once)));
 }
 
-e_colcode CSimpleCSV::read_col(std::ifstream &file, std::string &v)
+bool CFileBuffer::stream(int fd)
 {
-    char c;
-    v="";
+    ssize_t n; /* Bytes returned by the last read */
+    size_t used = 0;
     while (1)
     {
-        switch (c=file.get())
+        m_copy.resize(used + FIN_BLOCK);
+        n = ::read(fd, &m_copy[used], FIN_BLOCK);
+        if (n < 0)
         {
-        case EOF:
-            return(colcode_EOF);
-        case '\r':
-            if (file.peek()=='\n') file.get();
-            return(colcode_EOL);
-        case '\n':
-            if (file.peek()=='\r') file.get();
-            return(colcode_EOL);
-        case ',':
-            return(colcode_OK);
-        default:
-            if (file.good())
-                v.push_back(c);
-            else
-                return(colcode_FAIL);
+            if (errno == EINTR)
+                continue;
+            SYSERR("File read error");
+            return(false);
         }
+        if (n == 0)
+            break;
+        used += n;
     }
-    /* Never happens */
-    return(colcode_OK);
+    m_copy.resize(used);
+    m_data = m_copy.data();
+    m_size = used;
+    return(true);
 }
 
-bool CSimpleCSV::read_row(std::ifstream &file)
+bool CFileBuffer::open(const char *filename)
 {
-    unsigned char col; /* CSV column counter */
-    std::string v;     /* Raw column value from file */
-    /* Leading rows must have a comma */
-    for (col=0; col<FCOL_MAX-1; ++col)
+    struct stat st; /* Type and size of the input file */
+    int fd;
+    bool r = true;
+
+    close();
+    fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+        return(false);
+    if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0))
     {
-        if (read_col(file, v)==colcode_OK)
-            m_value[col] = trim(v);
-        else
-            return(false);
+        m_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m_map == MAP_FAILED)
+            m_map = NULL;
     }
-    /* Last row must not have a trailing comma or additional columns */
-    switch (read_col(file, v))
+    if (m_map)
     {
-        case colcode_EOL:
-        case colcode_EOF:
-            m_value[col] = trim(v);
-            break;
-        case colcode_OK:
-            /* Drain remaining characters on row */
-            while (read_col(file, v)==colcode_OK);
-            return(false);
-        default:
-            return(false);
+#ifdef MADV_SEQUENTIAL
+        /* Rows are tokenised front to back, let the kernel read ahead */
+        madvise(m_map, st.st_size, MADV_SEQUENTIAL);
+#endif
+        m_data = (const char *)m_map;
+        m_size = st.st_size;
     }
-    return(true);
+    else
+        r = stream(fd);
+    ::close(fd);
+    return(r);
 }
 
-void CSimpleCSV::dump(std::ostream &o)
+void CFileBuffer::close()
 {
-    for (std::vector<s_record>::const_iterator i = m_records.begin();
-         i != m_records.end(); ++i)
-        o << i->last  << ", " <<
-            i->first << ", " <<
-            i->score << std::endl;
+    if (m_map)
+        munmap(m_map, m_size);
+    m_map = NULL;
+    m_data = NULL;
+    m_size = 0;
+    std::vector<char>().swap(m_copy);
 }
 
-e_rwcode CSimpleCSV::read(const char *filename)
+char *CArena::grow(size_t n)
 {
-    unsigned long long line;      /* Line counetr */
-    m_discarded = 0;
-    std::ifstream file(filename);
-    if (!file.good() || !file.is_open())
+    size_t sz = (n > ARENA_BLOCK)?n:ARENA_BLOCK;
+    /* Make room for the pointer first so a throw cannot leak the block */
+    m_blocks.reserve(m_blocks.size()+1);
+    char *b = new char[sz];
+    m_blocks.push_back(b);
+    m_next = b + n;
+    m_limit = b + sz;
+    m_size += n;
+    return(b);
+}
+
+void CArena::adopt(CArena &other)
+{
+    m_blocks.insert(m_blocks.end(), other.m_blocks.begin(),
+                    other.m_blocks.end());
+    m_size += other.m_size;
+    other.m_blocks.clear();
+    other.m_next = other.m_limit = NULL;
+    other.m_size = 0;
+}
+
+void CArena::clear()
+{
+    for (size_t i=0; i<m_blocks.size(); ++i)
+        delete[] m_blocks[i];
+    std::vector<char *>().swap(m_blocks);
+    m_next = m_limit = NULL;
+    m_size = 0;
+}
+
+size_t CNames::find(const char *k, size_t n, uint32_t h) const
+{
+    size_t mask = m_slots.size() - 1;
+    for (size_t i=h & mask; ; i=(i + 1) & mask)
     {
-        print_error("Could not read input file");
-        return(rwcode_FAIL);
+        /* The slot holds what tells keys apart, so only a match reads the
+         * key itself */
+        const s_slot &s = m_slots[i];
+        if (!s.key ||
+            ((s.hash == h) && (s.len == n) && (memcmp(s.key, k, n) == 0)))
+            return(i);
     }
-    for (line=1; file.good(); ++line)
+}
+
+const char *CNames::add(char *k, size_t n, uint32_t h, size_t slot)
+{
+    uint32_t i = m_keys.size();
+    memcpy(k - sizeof(i), &i, sizeof(i));
+    m_keys.push_back(k);
+    m_len.push_back(n);
+    m_slots[slot].key = k;
+    m_slots[slot].hash = h;
+    m_slots[slot].len = n;
+    if (2*m_keys.size() > m_slots.size())
     {
-        if (read_row(file))
-        {
-            /* Validate and Store the row */
-            m_records.push_back(
-              s_record(m_value[FCOL_LAST],
-                       m_value[FCOL_FIRST],
-                       strtoull(m_value[FCOL_SCORE].data(), NULL, 10))
-            );
-        }
-        else
+        /* Keep the table at most half full so probes stay short */
+        std::vector<s_slot> slots(2*m_slots.size(), s_slot());
+        size_t mask = slots.size() - 1;
+        for (size_t j=0; j<m_slots.size(); ++j)
         {
-            ++m_discarded;
-            std::ostringstream msg;
-            msg << "Error on line " << line << ", discarded";
-            print_error(msg.str().data());
+            if (!m_slots[j].key)
+                continue;
+            size_t s = m_slots[j].hash & mask;
+            while (slots[s].key)
+                s = (s + 1) & mask;
+            slots[s] = m_slots[j];
         }
+        m_slots.swap(slots);
     }
-    file.close();
-    return(rwcode_OK);
+    return(k);
 }
 
-void CSimpleCSV::sort()
+const char *CNames::intern(CArena &arena, const char *k, size_t n,
+                           uint32_t h)
+{
+    if (m_slots.empty())
+        m_slots.resize(NAMES_SLOTS, s_slot());
+    ++m_seen;
+    size_t slot = find(k, n, h);
+    if (m_slots[slot].key)
+        return(m_slots[slot].key);
+    char *p = arena.alloc(sizeof(uint32_t) + n + 1) + sizeof(uint32_t);
+    memcpy(p, k, n);
+    p[n] = '\0';
+    return(add(p, n, h, slot));
+}
+
+const char *CNames::lookup(const CNames &other, uint32_t i) const
+{
+    if (m_slots.empty())
+        return(NULL);
+    const char *k = other.m_keys[i];
+    size_t slot = find(k, other.m_len[i], hash(k, other.m_len[i]));
+    return(m_slots[slot].key);
+}
+
+void CNames::adopt(const CNames &other, uint32_t i)
+{
+    if (m_slots.empty())
+        m_slots.resize(NAMES_SLOTS, s_slot());
+    char *k = other.m_keys[i];
+    uint32_t h = hash(k, other.m_len[i]);
+    size_t slot = find(k, other.m_len[i], h);
+    if (!m_slots[slot].key)
+        add(k, other.m_len[i], h, slot);
+}
+
+bool CNames::repeating()
 {
-    std::sort(m_records.begin(), m_records.end(), o_record_order);
+    if (m_seen < std::max<size_t>(NAMES_SAMPLE, m_keys.size()))
+        return(true);
+    bool r = 2*(m_keys.size() - m_known) <= m_seen;
+    m_seen = 0;
+    m_known = m_keys.size();
+    return(r);
 }
 
-e_rwcode CSimpleCSV::save(const char *filename)
+void CNames::rank()
 {
-    std::ofstream file(filename);
-    if (!file.good() || !file.is_open())
+    std::vector<uint32_t> ids(m_keys.size());
+    for (size_t i=0; i<ids.size(); ++i)
+        ids[i] = i;
+    std::sort(ids.begin(), ids.end(), [this](uint32_t a, uint32_t b)
+    {
+        return(strcmp(m_keys[a], m_keys[b]) < 0);
+    });
+    m_rank.resize(m_keys.size());
+    for (size_t i=0; i<ids.size(); ++i)
+    {
+        /* Keys only differing after a NUL compare equal, so rank equal */
+        bool tie = (i > 0) && (strcmp(m_keys[ids[i-1]], m_keys[ids[i]]) == 0);
+        m_rank[ids[i]] = tie?m_rank[ids[i-1]]:i;
+    }
+}
+
+void CNames::clear()
+{
+    std::vector<char *>().swap(m_keys);
+    std::vector<uint32_t>().swap(m_len);
+    std::vector<uint32_t>().swap(m_rank);
+    std::vector<s_slot>().swap(m_slots);
+    m_seen = m_known = 0;
+}
+
+void CWriter::write_fd(const char *p, size_t n)
+{
+    ssize_t w; /* Bytes accepted by the last write */
+    while (m_good && n)
+    {
+        w = ::write(m_fd, p, n);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            SYSERR("File write error");
+            m_good = false;
+            break;
+        }
+        p += w;
+        n -= w;
+        m_written += w;
+    }
+}
+
+void CWriter::put(unsigned long long v)
+{
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233"
+        "34353637383940414243444546474849505152535455565758596061626364656667"
+        "6869707172737475767778798081828384858687888990919293949596979899";
+    char d[20];        /* Enough for the largest 64 bit number */
+    char *p = d + sizeof(d);
+    /* Two digits at a time from the least significant end */
+    while (v >= 100)
+    {
+        unsigned int r = v % 100;
+        v /= 100;
+        *--p = pairs[2*r+1];
+        *--p = pairs[2*r];
+    }
+    if (v >= 10)
+    {
+        *--p = pairs[2*v+1];
+        *--p = pairs[2*v];
+    }
+    else
+        *--p = '0' + v;
+    put(p, d + sizeof(d) - p);
+}
+
+bool CWriter::flush()
+{
+    write_fd(m_buf.data(), m_used);
+    m_used = 0;
+    return(m_good);
+}
+
+bool CRun::create(unsigned int level, bool collate)
+{
+    const char *dir = getenv("TMPDIR"); /* Directory for the run */
+    close();
+    std::string name((dir && *dir)?dir:RUN_DIR);
+    name += "/grade-scores-XXXXXX";
+    m_fd = mkstemp(&name[0]);
+    if (m_fd < 0)
+        return(false);
+    unlink(name.c_str());
+    m_level = level;
+    m_collate = collate;
+    return(true);
+}
+
+void CRun::close()
+{
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+    m_rows = 0;
+    m_left = 0;
+    m_pos = 0;
+    m_len = 0;
+    m_offset = 0;
+}
+
+void CRun::put(CWriter &o, const s_record &r)
+{
+    s_runrow h; /* Fixed size part of the record */
+    h.score = r.score;
+    h.last_len = r.last_len;
+    h.first_len = r.first_len;
+    o.put((const char *)&h, sizeof(h));
+    o.put(r.last, r.last_len);
+    o.put(r.first, r.first_len);
+    ++m_rows;
+}
+
+void CRun::rewind(size_t block)
+{
+    m_buf.resize(block);
+    m_left = m_rows;
+    m_pos = 0;
+    m_len = 0;
+    m_offset = 0;
+}
+
+bool CRun::fill(size_t n)
+{
+    if (m_len - m_pos >= n)
+        return(true);
+    /* Keep the unconsumed bytes and read in behind them */
+    memmove(&m_buf[0], &m_buf[m_pos], m_len - m_pos);
+    m_len -= m_pos;
+    m_pos = 0;
+    if (m_buf.size() < n)
+        m_buf.resize(n);
+    while (m_len < n)
+    {
+        ssize_t r = pread(m_fd, &m_buf[m_len], m_buf.size() - m_len, m_offset);
+        if ((r < 0) && (errno == EINTR))
+            continue;
+        if (r <= 0)
+            return(false);
+        m_len += r;
+        m_offset += r;
+    }
+    return(true);
+}
+
+bool CRun::next(s_column &l, s_column &f, unsigned long long &s,
+                const char *&kl, const char *&kf)
+{
+    s_runrow h; /* Fixed size part of the record */
+    if ((m_left == 0) || !fill(sizeof(h)))
+        return(false);
+    memcpy(&h, &m_buf[m_pos], sizeof(h));
+    if (!fill(sizeof(h) + h.last_len + h.first_len))
+        return(false);
+    l.b = &m_buf[m_pos + sizeof(h)];
+    l.e = l.b + h.last_len;
+    f.b = l.e;
+    f.e = f.b + h.first_len;
+    m_pos += sizeof(h) + h.last_len + h.first_len;
+    /* Lower case names are derived again, as store() did */
+    size_t n = name_keys(m_lower, l, f, m_collate, NULL);
+    kl = m_lower.data();
+    kf = kl + n + 1;
+    s = h.score;
+    --m_left;
+    return(true);
+}
+
+void CSimpleCSV::trim(s_column &v)
+{
+    while ((v.b < v.e) && ((*v.b==' ') || (*v.b=='\r') || (*v.b=='\n')))
+        ++v.b;
+    while ((v.e > v.b) && ((v.e[-1]==' ') || (v.e[-1]=='\r') ||
+                           (v.e[-1]=='\n')))
+        --v.e;
+}
+
+e_colcode CSimpleCSV::read_col(const char *&p, const char *end,
+                               const char *&vb, const char *&ve)
+{
+    vb = p;
+    ve = p = m_scan.next(p);
+    if (p >= end)
+        return(colcode_EOF);
+    switch (*p++)
+    {
+    case '\r':
+        if ((p < end) && (*p=='\n')) ++p;
+        return(colcode_EOL);
+    case '\n':
+        if ((p < end) && (*p=='\r')) ++p;
+        return(colcode_EOL);
+    default:
+        /* Only other delimiter is ',' */
+        return(colcode_OK);
+    }
+}
+
+bool CSimpleCSV::read_row(const char *&p, const char *end)
+{
+    unsigned char col; /* CSV column counter */
+    s_column v;        /* Raw column value in buffer */
+    /* Leading rows must have a comma */
+    for (col=0; col<FCOL_MAX-1; ++col)
+    {
+        if (read_col(p, end, m_value[col].b, m_value[col].e)==colcode_OK)
+            trim(m_value[col]);
+        else
+            return(false);
+    }
+    /* Last row must not have a trailing comma or additional columns */
+    switch (read_col(p, end, m_value[col].b, m_value[col].e))
+    {
+        case colcode_EOL:
+        case colcode_EOF:
+            trim(m_value[col]);
+            break;
+        case colcode_OK:
+            /* Drain remaining characters on row */
+            while (read_col(p, end, v.b, v.e)==colcode_OK);
+            return(false);
+        default:
+            return(false);
+    }
+    return(true);
+}
+
+/** Write a record as a line of the graded output
+ * @param[in] o Writer to send the line to
+ * @param[in] r Record to be written
+ */
+static inline void put_record(CWriter &o, const s_record &r)
+{
+    o.put(r.last, r.last_len);
+    o.put(", ", 2);
+    o.put(r.first, r.first_len);
+    o.put(", ", 2);
+    o.put(r.score);
+    o.put('\n');
+}
+
+bool CSimpleCSV::dump(CWriter &o, unsigned long long limit)
+{
+    if (!m_runs.empty())
+    {
+        /* Externally sorted, merge the runs straight into the output */
+        std::vector<CRun*> runs;
+        while (m_runs.size() > m_ways)
+            if (!merge_tail())
+                return(false);
+        for (std::list<CRun>::iterator i=m_runs.begin(); i!=m_runs.end(); ++i)
+            runs.push_back(&*i);
+        return(merge(runs, o, limit, NULL));
+    }
+    for (size_t n=0; (n<m_records.size()) && (n<limit); ++n)
+    {
+        const s_record &r = record(n);
+        /* Records are visited in sorted order, fetch ahead of the writer */
+        if (!m_order.empty() && (n + DUMP_PREFETCH < m_order.size()))
+            __builtin_prefetch(&m_records[m_order[n + DUMP_PREFETCH]]);
+        put_record(o, r);
+    }
+    return(true);
+}
+
+bool CSimpleCSV::print(unsigned long long limit, int fd)
+{
+    STATS_PHASE(save_ns);
+    /* Anything already sent through std::cout must come out first */
+    std::cout.flush();
+    fflush(stdout);
+    CWriter o(fd);
+    bool ok = dump(o, limit);
+    ok = o.flush() && ok;
+    STATS_ADD(bytes_written, o.written());
+    return(ok);
+}
+
+e_rwcode CSimpleCSV::store()
+{
+    s_column l = m_value[FCOL_LAST];  /* Last name */
+    s_column f = m_value[FCOL_FIRST]; /* First name */
+    const char *kl, *kf;              /* Lower case names */
+    unsigned long long score;         /* Score */
+    /* Lengths and record indexes are held in 32 bits to keep them compact */
+    if (m_records.size() >= UINT32_MAX)
+    {
+        print_error("Too many records, the input cannot be graded");
+        return(rwcode_FAIL);
+    }
+    if ((l.size() > UINT32_MAX) || (f.size() > UINT32_MAX))
+        return(rwcode_DISCARD);
+    /* Anything but a plain decimal number which fits discards the row */
+    if (!parse_score(m_value[FCOL_SCORE].b, m_value[FCOL_SCORE].e, score))
+        return(rwcode_DISCARD);
+    /* The buffer goes once parsed if m_copy is set, so the names are copied
+     * to the arena as their keys are made */
+    size_t ln = l.size();
+    size_t fn = f.size();
+    char *o = m_copy?m_arena.alloc(ln + fn):NULL;
+    size_t n = name_keys(m_key, l, f, m_collate, o);
+    if ((n > UINT32_MAX) || (m_key.size() - n - 2 > UINT32_MAX))
+        return(rwcode_DISCARD);
+    if (o)
+    {
+        l.b = o;
+        l.e = f.b = o + ln;
+        f.e = o + ln + fn;
+    }
+    if (!m_topk && m_interned)
+    {
+        /* Records with the same names share their keys */
+        size_t kn = m_key.size() - n - 2;
+        uint32_t hl = CNames::hash(m_key.data(), n);
+        uint32_t hf = CNames::hash(m_key.data() + n + 1, kn);
+        m_names.prefetch(hl);
+        m_names.prefetch(hf);
+        kl = m_names.intern(m_arena, m_key.data(), n, hl);
+        kf = m_names.intern(m_arena, m_key.data() + n + 1, kn, hf);
+        /* When names hardly repeat the table costs more than it saves, the
+         * keys already shared stay as they are */
+        if (!m_names.repeating())
+        {
+            m_names.clear();
+            m_interned = false;
+        }
+    }
+    else
+    {
+        /* Heap records hold keys of their own, so compact() can reclaim the
+         * keys of records dropped from the heap, and so do records once the
+         * names stopped being interned */
+        char *k = m_arena.alloc(m_key.size());
+        memcpy(k, m_key.data(), m_key.size());
+        kl = k;
+        kf = k + n + 1;
+    }
+    m_records.push_back(
+      s_record(l, f, score, kl, kf)
+    );
+    return(rwcode_OK);
+}
+
+/** Bytes of arena storage holding the lower case name of a record
+ * @param[in] k       Lower case name
+ * @param[in] n       Length of the name
+ * @param[in] collate The name is a collation key, see CSimpleCSV::collate()
+ * @return Size of the NUL terminated lower case name
+ */
+static inline size_t key_size(const char *k, size_t n, bool collate)
+{
+    return((collate?strlen(k):n) + 1);
+}
+
+void CSimpleCSV::keep(unsigned long long line)
+{
+    s_topk t(m_records.back(), m_base + line);
+    m_records.pop_back();
+    offer(t);
+    if (m_arena.size() > 2*m_live + ARENA_BLOCK)
+        compact();
+}
+
+void CSimpleCSV::offer(const s_topk &t)
+{
+    if (m_heap.size() < m_topk)
+    {
+        m_heap.push_back(t);
+        std::push_heap(m_heap.begin(), m_heap.end(), o_topk_order);
+    }
+    else if (o_topk_order(t, m_heap.front()))
+    {
+        /* Replace the worst record kept so far */
+        m_live -= held(m_heap.front().rec);
+        std::pop_heap(m_heap.begin(), m_heap.end(), o_topk_order);
+        m_heap.back() = t;
+        std::push_heap(m_heap.begin(), m_heap.end(), o_topk_order);
+    }
+    else
+        return;
+    m_live += held(t.rec);
+}
+
+size_t CSimpleCSV::held(const s_record &r) const
+{
+    return(key_size(r.llast, r.last_len, m_collate) +
+           key_size(r.lfirst, r.first_len, m_collate) +
+           (m_copy?(r.last_len + r.first_len):0));
+}
+
+void CSimpleCSV::relocate(s_record &r, CArena &to) const
+{
+    size_t nl = key_size(r.llast, r.last_len, m_collate);
+    size_t nf = key_size(r.lfirst, r.first_len, m_collate);
+    char *k = to.alloc(held(r));
+    if (m_copy)
+    {
+        /* The names may still be in the input if m_copy was just set */
+        memcpy(k, r.last, r.last_len);
+        r.last = k;
+        k += r.last_len;
+        memcpy(k, r.first, r.first_len);
+        r.first = k;
+        k += r.first_len;
+    }
+    memcpy(k, r.llast, nl);
+    r.llast = k;
+    memcpy(k + nl, r.lfirst, nf);
+    r.lfirst = k + nl;
+}
+
+void CSimpleCSV::compact()
+{
+    CArena live; /* Names still referred to */
+    for (size_t i=0; i<m_records.size(); ++i)
+        relocate(m_records[i], live);
+    for (size_t i=0; i<m_heap.size(); ++i)
+        relocate(m_heap[i].rec, live);
+    m_arena.clear();
+    m_arena.adopt(live);
+    /* Every record has keys of its own now */
+    m_names.clear();
+    m_interned = false;
+}
+
+/** Find the first row boundary at or after a position. A row always ends in
+ * a run of line ending characters, and however the run pairs up into \r\n or
+ * \n\r endings the next row starts at the first character after the run.
+ * @param[in] p Position to search from
+ * @param[in] b First character of the buffer
+ * @param[in] e One past the last character of the buffer
+ * @return Start of the first row at or after p, e if there is none
+ */
+static const char *row_boundary(const char *p, const char *b, const char *e)
+{
+    for (; p < e; ++p)
+        if ((p > b) && ((p[-1]=='\r') || (p[-1]=='\n')) &&
+            (*p!='\r') && (*p!='\n'))
+            return(p);
+    return(e);
+}
+
+unsigned long long CSimpleCSV::parse(const char *&p, const char *e,
+                                     size_t budget)
+{
+    unsigned long long line;      /* Line counetr */
+    m_scan.reset(p, e);
+    for (line=1; (p < e) && (footprint() < budget); ++line)
+    {
+        const char *row = p; /* Start of the row */
+        /* Validate and Store the row */
+        e_rwcode rc = read_row(p, e)?store():rwcode_DISCARD;
+        if (rc == rwcode_FAIL)
+        {
+            p = row;
+            m_failed = true;
+            break;
+        }
+        if (rc == rwcode_DISCARD)
+        {
+            ++m_discarded;
+            m_rejects.push_back(line);
+            if (m_rawfd >= 0)
+            {
+                /* Kept as it was, less the line ending */
+                s_column raw = { row, p };
+                while ((raw.e > raw.b) &&
+                       ((raw.e[-1] == '\r') || (raw.e[-1] == '\n')))
+                    --raw.e;
+                m_raw.push_back(raw);
+            }
+        }
+        else
+        {
+            STATS_ADD(rows_accepted, 1);
+            if (m_topk)
+                keep(line);
+        }
+    }
+    return(line-1);
+}
+
+unsigned long long CSimpleCSV::parse_parallel(const char *b, const char *e)
+{
+    size_t n = std::min<size_t>(thread_count(m_threads), (e - b)/m_split);
+    std::vector<const char *> bound;       /* Slice i is bound[i]..bound[i+1] */
+    std::vector<unsigned long long> lines; /* Lines in each slice */
+    bound.push_back(b);
+    for (size_t i=1; i<n; ++i)
+    {
+        const char *p = row_boundary(b + (e - b)*i/n, b, e);
+        if (p > bound.back())
+            bound.push_back(p);
+    }
+    bound.push_back(e);
+    n = bound.size()-1;
+    lines.resize(n);
+    std::vector<CSimpleCSV> part(n);
+    parallel_for(n, m_threads, [&](size_t i)
+    {
+        const char *p = bound[i];
+        part[i].m_topk = m_topk;
+        part[i].m_rawfd = m_rawfd;
+        part[i].m_collate = m_collate;
+        lines[i] = part[i].parse(p, bound[i+1]);
+    });
+    /* Append each slice in file order, renumbering its discarded lines */
+    unsigned long long base = 0;
+    size_t total = m_records.size();
+    for (size_t i=0; i<n; ++i)
+    {
+        total += part[i].m_records.size();
+        m_failed = m_failed || part[i].m_failed;
+    }
+    /* Record indexes are held in 32 bits, as store() checks for each row */
+    if (!m_failed && (total >= UINT32_MAX))
+    {
+        print_error("Too many records, the input cannot be graded");
+        m_failed = true;
+    }
+    if (m_failed)
+        return(0);
+    m_records.reserve(total);
+    for (size_t i=0; i<n; ++i)
+    {
+        m_arena.adopt(part[i].m_arena);
+        if (!part[i].m_interned || !m_interned)
+        {
+            /* Records of a slice which stopped interning keep their keys */
+            m_names.clear();
+            m_interned = false;
+        }
+        else if (!m_topk)
+        {
+            /* Records of the slice share the keys already here, the other
+             * keys of the slice are taken over as they are */
+            CNames &names = part[i].m_names;
+            std::vector<const char *> keys(names.size());
+            for (size_t j=0; j<keys.size(); ++j)
+                keys[j] = m_names.lookup(names, j);
+            for (size_t j=0; j<part[i].m_records.size(); ++j)
+            {
+                s_record &r = part[i].m_records[j];
+                const char *k = keys[CNames::id(r.llast)];
+                r.llast = k?k:r.llast;
+                k = keys[CNames::id(r.lfirst)];
+                r.lfirst = k?k:r.lfirst;
+            }
+            for (size_t j=0; j<keys.size(); ++j)
+                if (!keys[j])
+                    m_names.adopt(names, j);
+        }
+        m_records.insert(m_records.end(), part[i].m_records.begin(),
+                         part[i].m_records.end());
+        /* Each slice kept its own best records, the best of those remain */
+        for (size_t j=0; j<part[i].m_heap.size(); ++j)
+        {
+            const s_topk &t = part[i].m_heap[j];
+            offer(s_topk(t.rec, m_base + base + t.line));
+        }
+        m_discarded += part[i].m_discarded;
+        STATS_ADD(rows_accepted, part[i].m_stats.rows_accepted);
+        for (size_t j=0; j<part[i].m_rejects.size(); ++j)
+            m_rejects.push_back(base + part[i].m_rejects[j]);
+        m_raw.insert(m_raw.end(), part[i].m_raw.begin(), part[i].m_raw.end());
+        base += lines[i];
+    }
+    return(base);
+}
+
+e_rwcode CSimpleCSV::read(const char *filename)
+{
+    struct stat st;               /* Identity of the input for the cache */
+    unsigned long long lines = 0; /* Lines parsed from the input */
+    /* The cache only covers records which all come from this file */
+    bool single = m_records.empty() && m_runs.empty() && !m_topk &&
+                  !m_budget;
+    if (strcmp(filename, "-") == 0)
+        return(read(STDIN_FILENO));
+    STATS_PHASE(read_ns);
+    start_read();
+    /* Records refer into the file, so it is kept open with the records */
+    m_inputs.resize(m_inputs.size()+1);
+    CFileBuffer &file = m_inputs.back();
+    if (!file.open(filename))
+    {
+        m_inputs.pop_back();
+        print_error("Could not read input file");
+        return(rwcode_FAIL);
+    }
+    STATS_ADD(bytes_read, file.size());
+    if (m_cache && single && (m_rawfd < 0) && !m_collate &&
+        (stat(filename, &st) == 0) && S_ISREG(st.st_mode) &&
+        ((size_t)st.st_size == file.size()))
+    {
+        memset(&m_source, 0, sizeof(m_source));
+        m_source.size = file.size();
+        m_source.mtime = st.st_mtim.tv_sec;
+        m_source.mtime_ns = st.st_mtim.tv_nsec;
+        m_source.hash = content_hash(file.begin(), file.size());
+        m_sidecar = std::string(filename) + FCACHE_EXT;
+        size_t done; /* Bytes of the input covered by the cache */
+        if (load_cache(m_sidecar.c_str(), m_source, file, done))
+        {
+            if (done == m_source.size)
+            {
+                /* Nothing new to save */
+                m_sidecar.clear();
+                report_rejects();
+                return(m_failed?rwcode_FAIL:rwcode_OK);
+            }
+            /* Rows were appended, parse only those and merge them in */
+            size_t n = m_records.size();
+            size_t r = m_rejects.size();
+            const char *p = file.begin() + done;
+            lines = parse(p, file.end());
+            if (m_failed)
+                return(rwcode_FAIL);
+            for (; r<m_rejects.size(); ++r)
+                m_rejects[r] += m_source.lines;
+            m_source.lines += lines;
+            if (m_sorted)
+                sort_appended(n);
+            report_rejects();
+            return(m_failed?rwcode_FAIL:rwcode_OK);
+        }
+    }
+    if (m_topk)
+    {
+        /* Records kept from earlier reads compete with the new rows */
+        for (m_base=0; m_base<m_records.size(); ++m_base)
+            offer(s_topk(m_records[m_base], m_base));
+        m_records.clear();
+    }
+    const char *p = file.begin(); /* Next row to parse */
+    if (!m_topk && m_budget)
+    {
+        /* Parse as many rows as the budget holds, then sort and spill them.
+         * Once anything has been spilled the remainder is spilled too. */
+        while (p < file.end())
+        {
+            size_t r = m_rejects.size();
+            unsigned long long n = parse(p, file.end(), m_budget);
+            if (m_failed)
+                return(rwcode_FAIL);
+            for (; r<m_rejects.size(); ++r)
+                m_rejects[r] += lines;
+            lines += n;
+            if (((p < file.end()) || !m_runs.empty()) && !spill())
+                return(rwcode_FAIL);
+        }
+    }
+    else if ((thread_count(m_threads) > 1) && (file.size() >= 2*m_split))
+        lines = parse_parallel(file.begin(), file.end());
+    else
+        lines = parse(p, file.end());
+    if (m_failed)
+        return(rwcode_FAIL);
+    m_source.lines = lines;
+    finish_read();
+    return(m_failed?rwcode_FAIL:rwcode_OK);
+}
+
+/** Find the end of the last complete row of a buffer, a row is complete
+ * once a character other than a line ending follows its line ending
+ * @param[in] b First character of the buffer
+ * @param[in] e One past the last character of the buffer
+ * @return Start of the last row, b if there is no complete row
+ */
+static const char *last_boundary(const char *b, const char *e)
+{
+    for (const char *p=e-1; p > b; --p)
+        if (((p[-1]=='\r') || (p[-1]=='\n')) && (*p!='\r') && (*p!='\n'))
+            return(p);
+    return(b);
+}
+
+e_rwcode CSimpleCSV::read(int fd)
+{
+    unsigned long long lines = 0; /* Lines parsed from the stream */
+    std::vector<char> block;      /* Rows read but not parsed yet */
+    size_t used = 0;              /* Bytes of block read */
+    bool eof = false;
+    STATS_PHASE(read_ns);
+    start_read();
+    if ((m_topk || m_budget) && !m_copy)
+    {
+        /* Blocks are let go once parsed, so records hold their own names */
+        m_copy = true;
+        compact();
+    }
+    if (m_topk)
+    {
+        /* Records kept from earlier reads compete with the new rows */
+        for (m_base=0; m_base<m_records.size(); ++m_base)
+            offer(s_topk(m_records[m_base], m_base));
+        m_records.clear();
+    }
+    unsigned long long base = m_base; /* Lines before the stream */
+    while (!eof)
+    {
+        /* Fill a whole block, pipes return less than asked for */
+        block.resize(used + m_chunk);
+        while (used < block.size())
+        {
+            ssize_t n = ::read(fd, &block[used], block.size() - used);
+            if ((n < 0) && (errno == EINTR))
+                continue;
+            if (n < 0)
+            {
+                SYSERR("File read error");
+                return(rwcode_FAIL);
+            }
+            if (n == 0)
+            {
+                eof = true;
+                break;
+            }
+            used += n;
+            STATS_ADD(bytes_read, n);
+        }
+        /* Only complete rows are parsed, the last row of the block may go
+         * on in the next one */
+        const char *b = block.data();
+        const char *e = eof?(b + used):last_boundary(b, b + used);
+        const char *p = b;
+        while (p < e)
+        {
+            size_t r = m_rejects.size();
+            m_base = base + lines;
+            lines += parse(p, e, (!m_topk && m_budget)?m_budget:SIZE_MAX);
+            if (m_failed)
+                return(rwcode_FAIL);
+            for (; r<m_rejects.size(); ++r)
+                m_rejects[r] += m_base - base;
+            if ((p < e) && !spill())
+                return(rwcode_FAIL);
+        }
+        /* Discarded rows refer into the block */
+        if (!write_raw())
+            return(rwcode_FAIL);
+        size_t rest = b + used - e; /* Bytes of the incomplete row */
+        if (m_copy)
+            memmove(&block[0], e, rest);
+        else if (e > b)
+        {
+            /* Records refer into the block, it is kept with them */
+            std::vector<char> tail(e, b + used);
+            block.resize(e - b);
+            m_inputs.resize(m_inputs.size()+1);
+            m_inputs.back().adopt(block);
+            block.swap(tail);
+        }
+        used = rest;
+    }
+    if (!m_topk && !m_runs.empty() && !spill())
+        return(rwcode_FAIL);
+    finish_read();
+    return(m_failed?rwcode_FAIL:rwcode_OK);
+}
+
+void CSimpleCSV::start_read()
+{
+    m_discarded = 0;
+    m_failed = false;
+    m_rejects.clear();
+    m_sidecar.clear();
+    /* Collation keys would be the names as they are, without case folding */
+    if (m_collate && bytewise_collation())
+        m_collate = false;
+    /* Any previous order does not cover the records about to be added */
+    m_order.clear();
+    m_sorted = false;
+}
+
+void CSimpleCSV::finish_read()
+{
+    if (m_topk)
+    {
+        /* The heap leaves the records it kept in sorted order */
+        std::sort_heap(m_heap.begin(), m_heap.end(), o_topk_order);
+        for (size_t i=0; i<m_heap.size(); ++i)
+            m_records.push_back(m_heap[i].rec);
+        m_heap.clear();
+        m_live = 0;
+        compact();
+    }
+    report_rejects();
+}
+
+void CSimpleCSV::report_rejects()
+{
+    STATS_ADD(rows_discarded, m_discarded);
+    write_raw();
+    if (m_rejects.empty())
+        return;
+    std::string msg; /* Lines shown, put together to be shown at once */
+    size_t n = std::min<unsigned long long>(m_show, m_rejects.size());
+    for (size_t i=0; i<n; ++i)
+    {
+        msg += "Error on line " + std::to_string(m_rejects[i]) +
+               ", discarded\n";
+    }
+    if (n < m_rejects.size())
+    {
+        msg += "Discarded " + std::to_string(m_rejects.size()) +
+               " lines in all";
+        if (n)
+            msg += ", the first " + std::to_string(n) + " are shown";
+    }
+    else
+        msg.erase(msg.size()-1);
+    print_error(msg.c_str());
+}
+
+bool CSimpleCSV::write_raw()
+{
+    if (m_raw.empty())
+        return(true);
+    CWriter o(m_rawfd);
+    for (size_t i=0; i<m_raw.size(); ++i)
+    {
+        o.put(m_raw[i].b, m_raw[i].size());
+        o.put('\n');
+    }
+    m_raw.clear();
+    if (!o.flush())
+    {
+        SYSERR("Could not write discarded rows file");
+        m_failed = true;
+        return(false);
+    }
+    return(true);
+}
+
+/** Fill a key/index pair from a record
+ * @param[out] ref   Pair to fill
+ * @param[in]  r     Record the pair stands in for
+ * @param[in]  index Position of the record in m_records
+ * @param[in]  how   How to pack the key
+ * @param[in]  base  Lowest inverted score of the records sorted together,
+ *                   which must be less than 2^32 below any of them unless
+ *                   how is refkey_SCORE
+ * @param[in]  names Names ranked by CNames::rank(), for refkey_RANK
+ */
+static inline void make_ref(s_sortref &ref, const s_record &r, uint32_t index,
+                            e_refkey how, unsigned long long base,
+                            const CNames &names)
+{
+    uint64_t off = r.key.score - base; /* Score offset, fits 32 bits */
+    ref.tie = index;
+    switch (how)
+    {
+    case refkey_RANK:
+        ref.key = (off << 32) | names.rank(r.llast);
+        ref.tie |= (uint64_t)names.rank(r.lfirst) << 32;
+        break;
+    case refkey_PREFIX:
+        ref.key = (off << 32) | (r.key.last >> 32);
+        break;
+    case refkey_NAME:
+        ref.key = r.key.last;
+        break;
+    default:
+        ref.key = r.key.score;
+        break;
+    }
+}
+
+e_refkey CSimpleCSV::ref_layout(size_t n, bool ranked,
+                                unsigned long long &base) const
+{
+    unsigned long long hi = 0; /* Highest inverted score */
+    base = ULLONG_MAX;
+    for (size_t i=n; i<m_records.size(); ++i)
+    {
+        base = std::min(base, m_records[i].key.score);
+        hi = std::max(hi, m_records[i].key.score);
+    }
+    if ((n == m_records.size()) || (hi - base > UINT32_MAX))
+        return(refkey_SCORE);
+    return(ranked?refkey_RANK:refkey_PREFIX);
+}
+
+void CSimpleCSV::set_order(const std::vector<s_sortref> &refs)
+{
+    m_order.resize(refs.size());
+    for (size_t i=0; i<refs.size(); ++i)
+        m_order[i] = refs[i].index();
+}
+
+void CSimpleCSV::sort_index()
+{
+    unsigned long long base; /* Lowest inverted score */
+    e_refkey how = ref_layout(0, m_ranked, base);
+    std::vector<s_sortref> refs(m_records.size());
+    for (size_t i=0; i<refs.size(); ++i)
+        make_ref(refs[i], m_records[i], i, how, base, m_names);
+    std::sort(refs.begin(), refs.end(),
+              s_sortref_order((how == refkey_RANK)?NULL:m_records.data()));
+    set_order(refs);
+}
+
+void CSimpleCSV::sort_appended(size_t n)
+{
+    unsigned long long base; /* Lowest inverted score */
+    e_refkey how = ref_layout(n, false, base);
+    std::vector<s_sortref> refs(m_records.size() - n);
+    for (size_t i=0; i<refs.size(); ++i)
+        make_ref(refs[i], m_records[n + i], n + i, how, base, m_names);
+    std::sort(refs.begin(), refs.end(), s_sortref_order(m_records.data()));
+    if (m_order.empty())
+    {
+        /* The sorted records were in order themselves */
+        m_order.resize(n);
+        for (size_t i=0; i<n; ++i)
+            m_order[i] = i;
+    }
+    std::vector<uint32_t> order; /* Merged order of all records */
+    order.reserve(m_records.size());
+    size_t i = 0; /* Next of the sorted records */
+    size_t j = 0; /* Next of the appended records */
+    while ((i < n) && (j < refs.size()))
+    {
+        if (record_cmp(m_records[refs[j].index()], m_records[m_order[i]]) < 0)
+            order.push_back(refs[j++].index());
+        else
+            order.push_back(m_order[i++]);
+    }
+    order.insert(order.end(), m_order.begin() + i, m_order.end());
+    for (; j<refs.size(); ++j)
+        order.push_back(refs[j].index());
+    m_order.swap(order);
+}
+
+void CSimpleCSV::sort_parallel()
+{
+    unsigned long long base; /* Lowest inverted score */
+    e_refkey how = ref_layout(0, m_ranked, base);
+    std::vector<s_sortref> refs(m_records.size());
+    for (size_t i=0; i<refs.size(); ++i)
+        make_ref(refs[i], m_records[i], i, how, base, m_names);
+    parallel_sort(refs, m_threads,
+                  s_sortref_order((how == refkey_RANK)?NULL:m_records.data()));
+    set_order(refs);
+}
+
+bool CSimpleCSV::sort_radix()
+{
+    unsigned long long lo = ULLONG_MAX; /* Lowest inverted score */
+    unsigned long long hi = 0;          /* Highest inverted score */
+    size_t i;
+
+    if (m_records.empty())
+        return(false);
+    for (i=0; i<m_records.size(); ++i)
+    {
+        lo = std::min(lo, m_records[i].key.score);
+        hi = std::max(hi, m_records[i].key.score);
+    }
+    if (hi - lo >= RADIX_RANGE)
+        return(false);
+    /* Count each score, then turn the counts into the start of each run.
+     * Inverted scores ascend, so the highest score comes first. */
+    std::vector<size_t> start(hi - lo + 2, 0);
+    for (i=0; i<m_records.size(); ++i)
+        ++start[m_records[i].key.score - lo + 1];
+    for (i=1; i<start.size(); ++i)
+        start[i] += start[i-1];
+    /* Scatter in input order, which keeps equal records in input order */
+    std::vector<s_sortref> refs(m_records.size());
+    std::vector<size_t> next(start.begin(), start.end()-1);
+    e_refkey how = m_ranked?refkey_RANK:refkey_NAME; /* Scores are close */
+    for (i=0; i<m_records.size(); ++i)
+        make_ref(refs[next[m_records[i].key.score - lo]++], m_records[i], i,
+                 how, lo, m_names);
+    /* Order each run of equal scores by name, runs are independent */
+    s_sortref_order order(m_ranked?NULL:m_records.data());
+    parallel_for(start.size()-1, m_threads, [&](size_t run)
+    {
+        std::sort(refs.begin()+start[run], refs.begin()+start[run+1], order);
+    });
+    set_order(refs);
+    return(true);
+}
+
+void CSimpleCSV::sort()
+{
+    STATS_PHASE(sort_ns);
+    sort_records();
+}
+
+void CSimpleCSV::sort_records()
+{
+    if (m_sorted)
+        return;
+    m_sorted = true;
+    /* Ranking the names pays when they repeat, it takes a sort of the
+     * distinct names and then names never have to be compared */
+    m_ranked = m_interned && (m_sortmode != sortmode_RECORD) &&
+               (m_names.size() <= m_records.size());
+    if (m_ranked)
+        m_names.rank();
+    switch (m_sortmode)
+    {
+    case sortmode_RECORD:
+        m_order.clear();
+        std::sort(m_records.begin(), m_records.end(), o_record_order);
+        break;
+    case sortmode_RADIX:
+        if (sort_radix())
+            break;
+        /* Score range too wide to count, sort by comparison instead, on
+         * every thread there is */
+        if (thread_count(m_threads) > 1)
+            sort_parallel();
+        else
+            sort_index();
+        break;
+    case sortmode_PARALLEL:
+        sort_parallel();
+        break;
+    default:
+        sort_index();
+        break;
+    }
+}
+
+bool CSimpleCSV::spill()
+{
+    if (m_records.empty())
+        return(true);
+    sort_records();
+    m_runs.emplace_back();
+    CRun &run = m_runs.back();
+    if (!run.create(0, m_collate))
+    {
+        SYSERR("Could not create temporary file");
+        return(false);
+    }
+    CWriter o(run.fd());
+    for (size_t n=0; n<m_records.size(); ++n)
+        run.put(o, record(n));
+    if (!o.flush())
+    {
+        SYSERR("Could not write temporary file");
+        return(false);
+    }
+    m_spilled += m_records.size();
+    m_records.clear();
+    m_order.clear();
+    m_sorted = false;
+    m_arena.clear();
+    m_names.clear();
+    m_interned = true;
+    /* Merge the latest runs once there are enough of the same level */
+    while ((m_runs.size() >= m_ways) &&
+           (std::prev(m_runs.end(), m_ways)->level() == m_runs.back().level()))
+        if (!merge_tail())
+            return(false);
+    return(true);
+}
+
+bool CSimpleCSV::merge_tail()
+{
+    std::list<CRun>::iterator b = std::prev(m_runs.end(), m_ways);
+    std::vector<CRun*> runs; /* Runs to be merged, in input order */
+    for (std::list<CRun>::iterator i=b; i!=m_runs.end(); ++i)
+        runs.push_back(&*i);
+    /* The merged run takes the place of the runs it is made of */
+    std::list<CRun>::iterator m = m_runs.emplace(b);
+    if (!m->create(b->level() + 1, m_collate))
+    {
+        SYSERR("Could not create temporary file");
+        return(false);
+    }
+    CWriter o(m->fd());
+    bool ok = merge(runs, o, ULLONG_MAX, &*m);
+    if (!o.flush() || !ok)
+    {
+        print_error("Could not merge temporary files");
+        return(false);
+    }
+    m_runs.erase(b, m_runs.end());
+    return(true);
+}
+
+bool CSimpleCSV::merge(const std::vector<CRun*> &runs, CWriter &o,
+                       unsigned long long limit, CRun *dest)
+{
+    std::vector<s_topk> heap; /* Next record of each run, line is the run */
+    s_column l, f;            /* Names of a record read back */
+    unsigned long long s;     /* Score of a record read back */
+    const char *kl, *kf;      /* Lower case names of a record read back */
+    size_t block = std::max<size_t>(RUN_BLOCK, m_budget/(runs.size() + 1));
+    /* Heap order puts the record which goes first at the front */
+    auto later = [](const s_topk &t1, const s_topk &t2)
+    {
+        return(o_topk_order(t2, t1));
+    };
+    for (size_t i=0; i<runs.size(); ++i)
+    {
+        runs[i]->rewind(block);
+        if (runs[i]->next(l, f, s, kl, kf))
+            heap.push_back(s_topk(s_record(l, f, s, kl, kf), i));
+        else if (!runs[i]->done())
+            return(false);
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+    for (unsigned long long n=0; !heap.empty() && (n<limit); ++n)
+    {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        s_topk &t = heap.back();
+        if (dest)
+            dest->put(o, t.rec);
+        else
+            put_record(o, t.rec);
+        /* The record written refers into its run until the next read */
+        CRun *run = runs[t.line];
+        if (run->next(l, f, s, kl, kf))
+        {
+            t.rec = s_record(l, f, s, kl, kf);
+            std::push_heap(heap.begin(), heap.end(), later);
+        }
+        else if (!run->done())
+            return(false);
+        else
+            heap.pop_back();
+    }
+    return(true);
+}
+
+/** Check that a lower case name of the sidecar cache is its name folded
+ * as parsing folds it, see fold_lower()
+ * @param[in] name  Name as read from the input
+ * @param[in] lower Lower case name held by the cache
+ * @param[in] n     Length of both
+ * @return TRUE if lower is the name in lower case
+ */
+static bool cache_lower(const char *name, const char *lower, size_t n)
+{
+    for (size_t i=0; i<n; ++i)
+    {
+        unsigned char c = name[i];
+        if ((unsigned char)lower[i] !=
+            (unsigned char)(c + (((unsigned char)(c - 'A') < 26) ?
+                                 ('a' - 'A') : 0)))
+            return(false);
+    }
+    return(true);
+}
+
+/** Check that a column of the sidecar cache lies within it
+ * @param[in] off   File offset of the column
+ * @param[in] n     Number of entries in the column
+ * @param[in] size  Size of each entry
+ * @param[in] total Size of the sidecar cache
+ * @return TRUE if the column is aligned and within the cache
+ */
+static bool cache_column(unsigned long long off, unsigned long long n,
+                         size_t size, size_t total)
+{
+    return((off % 8 == 0) && (off <= total) && (n <= (total - off)/size));
+}
+
+/** Check for a line ending character
+ * @param[in] c Character to check
+ * @return TRUE for \r or \n
+ */
+static inline bool is_eol(char c)
+{
+    return((c == '\r') || (c == '\n'));
+}
+
+bool CSimpleCSV::load_cache(const char *name, const s_cachehdr &src,
+                            const CFileBuffer &input, size_t &done)
+{
+    std::list<CFileBuffer> side(1); /* Sidecar cache, moved to m_inputs */
+    CFileBuffer &file = side.back();
+    if (!file.open(name) || (file.size() < sizeof(s_cachehdr)))
+        return(false);
+    s_cachehdr h;  /* Header of the cache */
+    memcpy(&h, file.begin(), sizeof(h));
+    size_t total = file.size();
+    if ((memcmp(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0) ||
+        (h.bom != CACHE_BOM) || (h.version != CACHE_VERSION) ||
+        (h.records >= UINT32_MAX) ||
+        ((h.orders != 0) && (h.orders != h.records)) ||
+        !cache_column(h.rows_off, h.records, sizeof(s_cacherow), total) ||
+        !cache_column(h.keys_off, h.records, sizeof(s_sortkey), total) ||
+        !cache_column(h.order_off, h.orders, sizeof(uint32_t), total) ||
+        !cache_column(h.rejects_off, h.rejects, sizeof(unsigned long long),
+                      total) ||
+        !cache_column(h.names_off, h.names_size, 1, total) ||
+        !cache_column(h.lower_off, h.lower_size, 1, total))
+        return(false);
+    /* Either the input is unchanged or rows have been appended to it. The
+     * cached part must end on a row boundary for the rest to be parsed on
+     * its own, otherwise it is all parsed again. */
+    if ((h.size != src.size) || (h.mtime != src.mtime) ||
+        (h.mtime_ns != src.mtime_ns) || (h.hash != src.hash))
+    {
+        const char *b = input.begin();
+        if ((h.size >= src.size) ||
+            ((h.size > 0) && (!is_eol(b[h.size-1]) || is_eol(b[h.size]))) ||
+            (content_hash(b, h.size) != h.hash))
+            return(false);
+    }
+    const s_cacherow *rows = (const s_cacherow *)(file.begin() + h.rows_off);
+    const s_sortkey *keys = (const s_sortkey *)(file.begin() + h.keys_off);
+    const uint32_t *order = (const uint32_t *)(file.begin() + h.order_off);
+    const unsigned long long *rejects =
+        (const unsigned long long *)(file.begin() + h.rejects_off);
+    const char *names = file.begin() + h.names_off;
+    const char *lower = file.begin() + h.lower_off;
+    /* Every name must lie within the cache, NUL terminated, and its lower
+     * case name must be the name folded */
+    for (size_t i=0; i<h.records; ++i)
+    {
+        const s_cacherow &r = rows[i];
+        unsigned long long n = (unsigned long long)r.last_len + r.first_len;
+        if ((r.names > h.names_size) || (n > h.names_size - r.names) ||
+            (r.lower > h.lower_size) || (n + 2 > h.lower_size - r.lower) ||
+            (lower[r.lower + r.last_len] != '\0') ||
+            (lower[r.lower + n + 1] != '\0') ||
+            !cache_lower(names + r.names, lower + r.lower, r.last_len) ||
+            !cache_lower(names + r.names + r.last_len,
+                         lower + r.lower + r.last_len + 1, r.first_len))
+            return(false);
+    }
+    /* The order must name each record once */
+    std::vector<bool> seen(h.orders);
+    for (size_t i=0; i<h.orders; ++i)
+    {
+        if ((order[i] >= h.records) || seen[order[i]])
+            return(false);
+        seen[order[i]] = true;
+    }
+    /* Records refer into the cache instead of the input. Their sort keys are
+     * built again from the lower case names rather than trusted. */
+    std::vector<s_record> records;
+    records.reserve(h.records);
+    for (size_t i=0; i<h.records; ++i)
+    {
+        const s_cacherow &r = rows[i];
+        s_column l = { names + r.names, names + r.names + r.last_len };
+        s_column f = { l.e, l.e + r.first_len };
+        const char *k = lower + r.lower;
+        records.push_back(s_record(l, f, ~keys[i].score, k,
+                                   k + r.last_len + 1));
+    }
+    /* A sorted cache must really be in order, or it is not used */
+    bool sorted = (h.orders != 0) || (h.sorted != 0);
+    for (size_t i=1; sorted && (i<h.records); ++i)
+    {
+        const s_record &a = records[h.orders?order[i-1]:i-1];
+        const s_record &b = records[h.orders?order[i]:i];
+        if (record_cmp(a, b) > 0)
+            return(false);
+    }
+    m_records.insert(m_records.end(), records.begin(), records.end());
+    /* Their lower case names are the ones of the cache, not in m_names */
+    m_interned = false;
+    m_order.assign(order, order + h.orders);
+    m_rejects.assign(rejects, rejects + h.rejects);
+    m_discarded = h.rejects;
+    STATS_ADD(rows_accepted, h.records);
+    m_sorted = sorted;
+    m_source.lines = h.lines;
+    done = h.size;
+    /* Appended rows will refer into the input, so it stays */
+    if (done == src.size)
+        m_inputs.pop_back();
+    m_inputs.splice(m_inputs.end(), side);
+    return(true);
+}
+
+e_rwcode CSimpleCSV::save_cache()
+{
+    if (m_sidecar.empty())
+        return(rwcode_OK);
+    s_cachehdr h = m_source; /* Header of the cache */
+    memcpy(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    h.bom = CACHE_BOM;
+    h.version = CACHE_VERSION;
+    h.sorted = m_sorted;
+    h.records = m_records.size();
+    h.orders = m_order.size();
+    h.rejects = m_rejects.size();
+    h.names_size = 0;
+    h.lower_size = 0;
+    for (size_t i=0; i<m_records.size(); ++i)
+    {
+        h.names_size += m_records[i].last_len + m_records[i].first_len;
+        h.lower_size += m_records[i].last_len + m_records[i].first_len + 2;
+    }
+    /* Columns follow the header in order, each padded to 8 bytes */
+    h.rows_off = (sizeof(h) + 7) & ~7ULL;
+    h.keys_off = h.rows_off + h.records*sizeof(s_cacherow);
+    h.order_off = h.keys_off + h.records*sizeof(s_sortkey);
+    h.rejects_off = (h.order_off + h.orders*sizeof(uint32_t) + 7) & ~7ULL;
+    h.names_off = h.rejects_off + h.rejects*sizeof(unsigned long long);
+    h.lower_off = (h.names_off + h.names_size + 7) & ~7ULL;
+
+    std::string tmp = m_sidecar + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        SYSERR("Could not write cache file");
+        return(rwcode_FAIL);
+    }
+    CWriter o(fd);
+    static const char pad[8] = { 0 };
+    o.put((const char *)&h, sizeof(h));
+    o.put(pad, h.rows_off - sizeof(h));
+    unsigned long long names = 0; /* Offset of the next names */
+    unsigned long long lower = 0; /* Offset of the next lower case names */
+    for (size_t i=0; i<m_records.size(); ++i)
+    {
+        const s_record &r = m_records[i];
+        s_cacherow c;
+        c.names = names;
+        c.lower = lower;
+        c.last_len = r.last_len;
+        c.first_len = r.first_len;
+        o.put((const char *)&c, sizeof(c));
+        names += r.last_len + r.first_len;
+        lower += r.last_len + r.first_len + 2;
+    }
+    for (size_t i=0; i<m_records.size(); ++i)
+        o.put((const char *)&m_records[i].key, sizeof(s_sortkey));
+    if (!m_order.empty())
+        o.put((const char *)&m_order[0], m_order.size()*sizeof(uint32_t));
+    o.put(pad, h.rejects_off - (h.order_off + h.orders*sizeof(uint32_t)));
+    if (!m_rejects.empty())
+        o.put((const char *)&m_rejects[0],
+              m_rejects.size()*sizeof(unsigned long long));
+    for (size_t i=0; i<m_records.size(); ++i)
+    {
+        o.put(m_records[i].last, m_records[i].last_len);
+        o.put(m_records[i].first, m_records[i].first_len);
+    }
+    o.put(pad, h.lower_off - (h.names_off + h.names_size));
+    for (size_t i=0; i<m_records.size(); ++i)
+    {
+        o.put(m_records[i].llast, m_records[i].last_len + 1);
+        o.put(m_records[i].lfirst, m_records[i].first_len + 1);
+    }
+    bool ok = o.flush();
+    if ((::close(fd) != 0) || !ok ||
+        (rename(tmp.c_str(), m_sidecar.c_str()) != 0))
+    {
+        SYSERR("Could not write cache file");
+        unlink(tmp.c_str());
+        return(rwcode_FAIL);
+    }
+    return(rwcode_OK);
+}
+
+e_rwcode CSimpleCSV::save(const char *filename, unsigned long long limit)
+{
+    STATS_PHASE(save_ns);
+    int fd = ::open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        print_error("Could not write output file");
+        return(rwcode_FAIL);
+    }
+    CWriter o(fd);
+    bool ok = dump(o, limit);
+    ok = o.flush() && ok;
+    STATS_ADD(bytes_written, o.written());
+    if ((::close(fd) != 0) || !ok)
     {
         print_error("Could not write output file");
         return(rwcode_FAIL);
     }
-    dump(file);
-    file.close();
     return(rwcode_OK);
-} 
+}
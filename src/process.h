@@ -10,6 +10,11 @@
 #include <string.h>
 #include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <locale.h>
 
 /* Standard C++ library */
 #include <iostream>
@@ -19,14 +24,44 @@
 #include <vector>       // std::vector
 #include <sstream>
 #include <ostream>
+#include <list>
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <type_traits>
+
+/* Project C++ library */
+#include "scan.h"
+#include "parallel.h"
 
 /* Constants */
 /* --------- */
 
 #define EXIT_FAIL -1 //!< Exit code on failure
 #define EXIT_OK    0 //!< Exit code on successful completion
-#define MAX_ARGS   1 //!< Maximum number of command line arguments
 #define FOUT_EXT   "-graded" //!< Extension for filename
+#define FREJECT_EXT "-rejected" //!< Extension for the discarded rows file
+#define FREJECT_STDIN "stdin"   //!< Discarded rows file name for stdin
+#define DISCARD_SHOW 10      //!< Discarded line numbers shown by default
+#define FIN_BLOCK  (1<<20)   //!< Block size used when input cannot be mapped
+#define ARENA_BLOCK (1<<20)  //!< Default size of each CArena block
+#define KEY_PREFIX 8         //!< Bytes of each lower case name in s_sortkey
+#define NAMES_SLOTS 1024     //!< Initial hash slots of a CNames table
+#define NAMES_SAMPLE (1<<15) //!< Names interned before CNames::repeating()
+                             //!< first looks at how many were new
+#define DUMP_PREFETCH 8      //!< Records fetched ahead when writing in order
+#define RADIX_RANGE (1<<16)  //!< Widest score range sorted by counting
+#define READ_SPLIT (1<<20)   //!< Smallest input slice parsed by one thread
+#define FOUT_BLOCK (1<<20)   //!< Size of the CWriter output buffer
+#define MERGE_WAYS 64        //!< Most sorted runs merged at once
+#define RUN_BLOCK  (1<<16)   //!< Smallest read buffer of each sorted run
+#define RUN_DIR    "/tmp"    //!< Directory for sorted runs if TMPDIR is unset
+#define FCACHE_EXT ".cache"  //!< Extension of the sidecar cache of an input
+#define CACHE_MAGIC "GSCACHE" //!< First bytes of a sidecar cache
+#define CACHE_VERSION 2      //!< Version of the sidecar cache, raised when
+                             //!< its layout or the rows accepted change
+#define CACHE_BOM 0x01020304 //!< Written as is to detect foreign byte order
+#define STATS_ENV  "GRADE_STATS" //!< Environment variable enabling --stats
 
 /* Enumerations */
 /* ------------ */
@@ -58,58 +93,276 @@ typedef enum
     colcode_FAIL,     //!< Check std steam code
 } e_colcode;
 
+/** Algorithm used by CSimpleCSV::sort */
+typedef enum
+{
+    sortmode_RECORD = 0, //!< std::sort moving the records themselves
+    sortmode_INDEX,      //!< Sort compact key/index pairs, records stay put
+    sortmode_RADIX,      //!< Counting sort on score then names per score,
+                         //!< falls back to sortmode_INDEX for wide ranges
+    sortmode_PARALLEL,   //!< Merge sort of key/index pairs across threads
+} e_sortmode;
+
+/** How the key of a s_sortref is packed from its record */
+typedef enum
+{
+    refkey_RANK = 0, //!< Score offset above the last name rank, the first
+                     //!< name rank is in the tie, so the pair is exact
+    refkey_PREFIX,   //!< Score offset above 4 bytes of the last name
+    refkey_NAME,     //!< 8 bytes of the last name, scores being equal
+    refkey_SCORE,    //!< Inverted score alone, for scores too far apart
+} e_refkey;
+
 /* Structures */
 /* ---------- */
 
+/** Column of a CSV row. The text is not copied, it refers into the buffer
+ * the row was read from.
+ */
+struct s_column
+{
+    const char *b; //!< First character of the column
+    const char *e; //!< One past the last character of the column
+
+    /** Length of the column
+     * @return Number of characters in the column
+     */
+    size_t size() const { return e - b; }
+};
+
+/** Packed sort key of a record. Each member compares as an unsigned integer
+ * in the same order as the field it is derived from, so most comparisons
+ * are settled by one or two integer compares on contiguous memory.
+ * Names hold the first #KEY_PREFIX bytes of the NUL terminated lower case
+ * name, most significant byte first and zero padded. The low byte is zero
+ * only when the whole name fits in the prefix, otherwise the remainder has
+ * to be compared when prefixes tie.
+ */
+struct s_sortkey
+{
+    unsigned long long score; //!< Inverted score, highest score first
+    uint64_t last;            //!< Lower case last name prefix
+    uint64_t first;           //!< Lower case first name prefix
+
+    /** Pack the leading bytes of a name so they compare like strcmp
+     * @param[in] s NUL terminated lower case name
+     * @return Name prefix, most significant byte first
+     */
+    static uint64_t prefix(const char *s)
+    {
+        uint64_t k = 0;
+        for (unsigned int i=0; (i<KEY_PREFIX) && s[i]; ++i)
+            k |= (uint64_t)(unsigned char)s[i] << (8*(KEY_PREFIX-1-i));
+        return(k);
+    }
+};
+
 /** Structure to store a record of information read from CSV file.
  * The file has the format:
  *     LastName, FirstName, Score
+ * The names are not copied, they refer into the input file which CSimpleCSV
+ * keeps mapped for as long as it holds records. The sort keys of both names
+ * are NUL terminated and held in the arena owned by CSimpleCSV, where
+ * records with the same name share them through CNames. They are the names
+ * in lower case, or their strxfrm() keys when CSimpleCSV::collate() is set,
+ * and compare with strcmp() either way. The record itself is trivially
+ * copyable and owns nothing, so it is cheap to move and needs no
+ * destruction.
  */
 struct s_record
 {
-    /* Original values as read from file */
-    std::string last;  //!< Last name
-    std::string first; //!< First name
-    unsigned long long score;  //!< Score
-    /* For speed, preconvert strings to all lower case.
-     * Not so memory friendly.
-     */
-    std::string llast;  //!< Last name all lower case
-    std::string lfirst; //!< First name all lower case
+    const char *last;         //!< Last name, not NUL terminated
+    const char *first;        //!< First name, not NUL terminated
+    uint32_t last_len;        //!< Length of last name
+    uint32_t first_len;       //!< Length of first name
+    unsigned long long score; //!< Score
+    const char *llast;        //!< Last name all lower case, NUL terminated
+    const char *lfirst;       //!< First name all lower case, NUL terminated
+    s_sortkey key;            //!< Packed sort key
 
-    /** Contructor. Initialises internal variables and stored a transform
-     * of the passed string to lower case.
-     * @param[in] l Last name
-     * @param[in] f First name
-     * @param[in] s Score
+    /** Contructor. Refers to the names where they were read from.
+     * @param[in] l  Last name
+     * @param[in] f  First name
+     * @param[in] s  Score
+     * @param[in] kl Lower case last name
+     * @param[in] kf Lower case first name
      */
-    s_record(std::string &l, std::string &f, unsigned long long s) :
-        last(l), first(f), score(s), llast(l), lfirst(f)
+    s_record(const s_column &l, const s_column &f, unsigned long long s,
+             const char *kl, const char *kf) :
+        last(l.b), first(f.b), last_len(l.size()), first_len(f.size()),
+        score(s), llast(kl), lfirst(kf)
     {
-        /* Transform to all lower case for faster comparison later */
-        std::transform(llast.begin(), llast.end(), llast.begin(), ::tolower);
-        std::transform(lfirst.begin(), lfirst.end(), lfirst.begin(), ::tolower);
+        key.score = ~s;
+        key.last = s_sortkey::prefix(llast);
+        key.first = s_sortkey::prefix(lfirst);
     }
 };
 
+/** Compact stand in for a record while sorting. It is 16 bytes and
+ * trivially copyable, so sorting moves as little memory as possible and
+ * the record itself is only read back to settle ties. Both members compare
+ * as unsigned integers, key first. How the key is packed depends on the
+ * sort, see make_ref(): with names ranked by CNames the pair orders exactly
+ * like the records, otherwise it holds the score and a name prefix, and
+ * records whose keys tie are compared in full.
+ */
+struct s_sortref
+{
+    uint64_t key; //!< Score and last name, as far as they fit
+    uint64_t tie; //!< Rank of the first name, if ranked, in the high 32 bits
+                  //!< and position of the record in CSimpleCSV::m_records
+
+    /** Position of the record
+     * @return Index into CSimpleCSV::m_records
+     */
+    uint32_t index() const { return((uint32_t)tie); }
+};
+static_assert(sizeof(s_sortref) == 16,
+              "s_sortref must stay 16 bytes, four to a cache line");
+static_assert(std::is_trivially_copyable<s_sortref>::value,
+              "s_sortref is moved around by the sorts as plain bytes");
+
+/** Record held by the top-K heap of CSimpleCSV, with its position in the
+ * input so records which compare equal keep their input order
+ */
+struct s_topk
+{
+    s_record rec;            //!< Candidate record
+    unsigned long long line; //!< Input line the record was read from
+
+    /** Constructor
+     * @param[in] r Record
+     * @param[in] l Input line the record was read from
+     */
+    s_topk(const s_record &r, unsigned long long l) : rec(r), line(l) {}
+};
+
+/** Header of a record in a sorted run file, followed by the last name and
+ * then the first name as they were read. Lower case names are not stored,
+ * they are derived again when the run is read back.
+ */
+struct s_runrow
+{
+    unsigned long long score; //!< Score
+    uint32_t last_len;        //!< Length of last name
+    uint32_t first_len;       //!< Length of first name
+};
+
+/** Header of the sidecar cache of an input file. It identifies the input
+ * the cache was built from and locates each column of the cache. Columns
+ * hold one entry per record in input order and start on 8 byte boundaries:
+ *     rows    s_cacherow, where the names of the record are
+ *     keys    s_sortkey, packed sort key including the inverted score
+ *     order   uint32_t, sorted order of the records, may be empty
+ *     rejects unsigned long long, line numbers of discarded rows
+ *     names   names as they were read, last then first name of each record
+ *     lower   lower case names, NUL terminated, last then first name
+ */
+struct s_cachehdr
+{
+    char magic[8];                   //!< #CACHE_MAGIC
+    uint32_t bom;                    //!< #CACHE_BOM
+    uint32_t version;                //!< #CACHE_VERSION
+    unsigned long long size;         //!< Size of the input
+    long long mtime;                 //!< Modification time of the input, s
+    long long mtime_ns;              //!< Nanoseconds of the modification time
+    uint64_t hash;                   //!< content_hash() of the input
+    unsigned long long lines;        //!< Lines parsed from the input
+    unsigned long long sorted;       //!< Non zero if rows are in sorted order
+                                     //!< when no order column is present
+    unsigned long long records;      //!< Entries of rows and keys
+    unsigned long long orders;       //!< Entries of order, 0 or records
+    unsigned long long rejects;      //!< Entries of rejects
+    unsigned long long names_size;   //!< Bytes of names
+    unsigned long long lower_size;   //!< Bytes of lower
+    unsigned long long rows_off;     //!< File offset of rows
+    unsigned long long keys_off;     //!< File offset of keys
+    unsigned long long order_off;    //!< File offset of order
+    unsigned long long rejects_off;  //!< File offset of rejects
+    unsigned long long names_off;    //!< File offset of names
+    unsigned long long lower_off;    //!< File offset of lower
+};
+
+/** Where the names of a record are held in the sidecar cache */
+struct s_cacherow
+{
+    unsigned long long names; //!< Offset of the names within names
+    unsigned long long lower; //!< Offset of the lower case names in lower
+    uint32_t last_len;        //!< Length of last name
+    uint32_t first_len;       //!< Length of first name
+};
+
+/** Options given on the command line */
+struct s_options
+{
+    bool quiet;              //!< Do not echo the sorted records
+    unsigned long long top;  //!< Maximum number of records echoed
+    unsigned long long keep; //!< Records kept while reading, 0 for all
+    size_t budget;           //!< Memory for sorting in bytes, 0 for no limit
+    bool cache;              //!< Keep a sidecar cache next to the input
+    const char *echo;        //!< Echo destination: stdout, stderr or a file
+    unsigned int jobs;       //!< Files graded at once, 0 for one per CPU
+    unsigned int threads;    //!< Threads each file is graded on, 0 to share
+                             //!< the CPUs among the files graded at once
+    bool stats;              //!< Report the statistics of each file
+    unsigned long long show; //!< Discarded line numbers shown per file
+    bool rejects;            //!< Write the discarded rows of each file
+    bool collate;            //!< Order names as the locale collates them
+    bool piped;              //!< Standard output holds standard input
+                             //!< graded along with files, whose echo and
+                             //!< messages go to stderr
+};
+
+/** Phase timings and counters of a CSimpleCSV, accumulated over its life.
+ * Nothing is counted when built with NOSTATS.
+ */
+struct s_stats
+{
+    unsigned long long read_ns;        //!< Time in read()
+    unsigned long long sort_ns;        //!< Time in sort()
+    unsigned long long save_ns;        //!< Time in save() and print()
+    unsigned long long bytes_read;     //!< Input bytes read
+    unsigned long long rows_accepted;  //!< Rows stored as records
+    unsigned long long rows_discarded; //!< Rows discarded
+    unsigned long long comparisons;    //!< Records compared, see CStatsTimer
+    unsigned long long bytes_written;  //!< Bytes of sorted output written
+};
+
+/** Input file to be graded and where its output goes. Each job is graded
+ * on its own, so everything derived from its name is held here.
+ */
+struct s_job
+{
+    std::string src;       //!< Source file name
+    char ofname[PATH_MAX]; //!< Output file name
+    char rfname[PATH_MAX]; //!< Discarded rows file name
+    size_t ofshort;        //!< Offset into ofname for filename less path
+};
+
 /* Global variables */
 /* ---------------- */
 
-extern char g_ofname[PATH_MAX]; //!< Output file name
-extern size_t g_ofshort;        //!< Offset into g_ofname for filename less path
+extern s_options g_opts;           //!< Command line options
+extern std::vector<s_job> g_jobs;  //!< Input files to be graded
+extern unsigned int g_failed;      //!< Input files rejected before grading
 
 /* Macros, Functions and Classes */
 /* ----------------------------- */
 
-/** Reference to the filename parameter passed on the command line */
-#define SRC (argv[1])
-
 /** Print a message to the console. This can be modified for system logging
- * or other future requirements.
+ * or other future requirements. Messages from different threads do not mix
+ * and are prefixed with the error_context() of the thread, if any.
  * @param[in] message Message to be logged
  */
 extern void print_error(const char *message);
 
+/** Name what the calling thread is working on, so the messages it prints
+ * can be told apart from those of other jobs
+ * @param[in] name Input file name, NULL for no prefix. Must stay valid
+ *                 until the context is changed.
+ */
+extern void error_context(const char *name);
+
 /** Print a message to the console when a function which sets errno has failed.
  * See the #SYSERR(message) which can be used to fill f, l and e parameters.
  * This can be modified for system logging or other future requirements.
@@ -127,15 +380,646 @@ extern void print_error(const char *f, int l, int e,
  */
 #define SYSERR(message) print_error(__FILE__, __LINE__, errno, (message))
 
-/** Make sure the file input and output names are valid and a file exists.
- * Populate the global g_ofname with the destination file name.
+/** Hash a block of bytes, used to recognise input which has already been
+ * cached. Not a cryptographic hash.
+ * @param[in] p First byte of the block
+ * @param[in] n Number of bytes in the block
+ * @return 64 bit hash of the block
+ */
+extern uint64_t content_hash(const char *p, size_t n);
+
+/** Convert a score field. Only decimal digits are accepted, no sign, white
+ * space or anything after the number, and the value must fit in 64 bits.
+ * Fields of 8 digits or more are converted 8 digits at a time.
+ * @param[in]  b First character of the field
+ * @param[in]  e One past the last character of the field
+ * @param[out] v Score, only set on success
+ * @return TRUE if the field is a valid score, FALSE otherwise
+ */
+extern bool parse_score(const char *b, const char *e, unsigned long long &v);
+
+/** Copy characters folding ASCII upper case to lower case, 8 at a time where
+ * the field is long enough. Other characters, including any with the top bit
+ * set, are copied unchanged, as ::tolower does in the "C" locale.
+ * @param[out] d Where the lower case characters go
+ * @param[in]  b First character to fold
+ * @param[in]  e One past the last character to fold
+ * @param[out] o Where the characters also go unchanged, NULL for nowhere
+ * @return One past the last lower case character written
+ */
+extern char *fold_lower(char *d, const char *b, const char *e, char *o);
+
+/** Make sure the input and output names of a file are valid and the file
+ * exists, and derive the output and discarded rows file names from the
+ * input file name. The name "-" stands for standard input, graded to
+ * standard output with its discarded rows in #FREJECT_STDIN.
+ * @param[in]  src Input file name
+ * @param[out] job Job grading the file, populated on success
+ * @return TRUE if the file can be graded, FALSE otherwise
+ */
+extern bool make_job(const char *src, s_job &job);
+
+/** Make sure the file input and output names are valid and the files exist.
+ * Populate g_jobs with a job for each input file and g_opts with the
+ * command line options. Input files may be named on the command line, a
+ * directory stands for every file in it other than graded output and
+ * caches, and "-" for standard input. When standard input is graded along
+ * with files, the files echo to stderr rather than stdout so that only the
+ * sorted standard input is written there, see s_options::piped. Files
+ * which cannot be graded are reported and counted in g_failed. Options may
+ * appear anywhere on the line:
+ *     -q       Quiet, do not echo the sorted records
+ *     -n rows  Echo at most this many of the sorted records
+ *     -k rows  Keep only this many of the best records while reading, the
+ *              saved file and the echo hold no more than that
+ *     -m MiB   Sort within about this much memory, spilling sorted runs to
+ *              temporary files and merging them into the output
+ *     -c       Keep a binary cache of the parsed and sorted input next to
+ *              it, later runs load it instead of parsing and sorting
+ *     -d lines Show at most this many discarded line numbers of each file,
+ *              then the total discarded, default #DISCARD_SHOW
+ *     -r       Write the discarded rows of each file, as they were, to a
+ *              file named like the output with #FREJECT_EXT
+ *     --stats  Show the phase times and counters of each file on stderr,
+ *              also enabled by a non-zero #STATS_ENV environment variable
+ *     --collate Order names as the locale collates them, see
+ *              CSimpleCSV::collate()
+ *     -e dest  Echo to stdout (default), stderr or the named file
+ *     -l list  Also grade the files named in list, one per line
+ *     -j jobs  Grade this many files at once, default one per CPU
+ *     -t threads Parse and sort each file on this many threads, default
+ *              the CPUs shared among the files graded at once, see
+ *              job_threads()
  * @param[in] argc Number of command line arguments
  * @param[in] argv Array of command line arguments
- * @return TRUE if input/output filenames are valid and the specified file
- *         exists, FALSE otherwise
+ * @return TRUE if the options are valid and at least one file can be
+ *         graded, FALSE otherwise
  */
 extern bool validate_arg(const int argc, char **argv);
 
+/** Threads each file is parsed and sorted on, as -t asked. By default the
+ * CPUs are shared among the files graded at once, so -j jobs and the
+ * threads of each job together keep every CPU busy without oversubscribing
+ * them.
+ * @param[in] files Number of files to be graded
+ * @return Threads for each file, at least 1
+ */
+extern unsigned int job_threads(size_t files);
+
+/** Whether the LC_COLLATE category of the current locale is C, POSIX or
+ * C.UTF-8, which collate bytewise. strxfrm() then only copies the names,
+ * so CSimpleCSV::collate() would lose the case folding of the default order.
+ * @return TRUE if names collate as their bytes, FALSE otherwise
+ */
+extern bool bytewise_collation();
+
+/** Show statistics as one JSON line on stderr
+ * @param[in] name  Input the statistics are for
+ * @param[in] stats Statistics
+ */
+extern void print_stats(const char *name, const s_stats &stats);
+
+#ifndef NOSTATS
+/** Times a phase of CSimpleCSV from construction to destruction, and counts
+ * the records compared meanwhile. Comparisons are counted per thread, those
+ * of worker threads are collected as the threads end, so comparisons of
+ * other objects sorting on several threads at the same time may be
+ * included.
+ */
+class CStatsTimer
+{
+    unsigned long long &m_ns;       /**< Time of the phase */
+    unsigned long long &m_compares; /**< Comparisons of the phase */
+    std::chrono::steady_clock::time_point m_start; /**< Start of the phase */
+    unsigned long long m_base;      /**< Comparisons made before the phase */
+
+public:
+    /** Constructor, starts the timer
+     * @param[in,out] ns       Nanoseconds to add the time of the phase to
+     * @param[in,out] compares Count to add the comparisons of the phase to
+     */
+    CStatsTimer(unsigned long long &ns, unsigned long long &compares);
+
+    /** Destructor, stops the timer */
+    ~CStatsTimer();
+};
+
+/** Time the rest of the enclosing CSimpleCSV method as a phase */
+#define STATS_PHASE(ns) CStatsTimer stats_phase(m_stats.ns, m_stats.comparisons)
+/** Add to a counter of m_stats */
+#define STATS_ADD(counter, n) (m_stats.counter += (n))
+#else
+#define STATS_PHASE(ns)
+#define STATS_ADD(counter, n)
+#endif
+
+/** Read only byte buffer holding the complete contents of an input file.
+ * Regular files are memory mapped so rows can be tokenised straight out of
+ * the page cache. Anything which cannot be mapped (pipes, character devices,
+ * empty files) is streamed in blocks of #FIN_BLOCK bytes into an owned buffer
+ * instead.
+ */
+class CFileBuffer
+{
+    const char *m_data;       /**< Start of file contents */
+    size_t m_size;            /**< Number of bytes available at m_data */
+    void *m_map;              /**< Address returned by mmap, NULL if unmapped */
+    std::vector<char> m_copy; /**< Storage when the file could not be mapped */
+
+    /** Read the whole of an open file descriptor into m_copy
+     * @param[in] fd Open file descriptor
+     * @return TRUE if the file was read up to end of file, FALSE otherwise
+     */
+    bool stream(int fd);
+
+public:
+    /** Constructor */
+    CFileBuffer() : m_data(NULL), m_size(0), m_map(NULL) {}
+
+    /** Map or read the contents of the specified file
+     * @param[in] filename Name of file to read
+     * @return TRUE if the contents are available, FALSE otherwise
+     */
+    bool open(const char *filename);
+
+    /** Take over a block already read into memory
+     * @param[in,out] data Block to hold, left empty
+     */
+    void adopt(std::vector<char> &data)
+    {
+        close();
+        m_copy.swap(data);
+        m_data = m_copy.data();
+        m_size = m_copy.size();
+    }
+
+    /** Release the contents of the file */
+    void close();
+
+    /** First byte of the file contents
+     * @return Pointer to the first byte of the file
+     */
+    const char *begin() const { return m_data; }
+
+    /** One past the last byte of the file contents
+     * @return Pointer to one past the last byte of the file
+     */
+    const char *end() const { return m_data + m_size; }
+
+    /** Size of the file contents
+     * @return Number of bytes in the file
+     */
+    size_t size() const { return m_size; }
+
+    /* *** C++ Big Three *** */
+    ~CFileBuffer() { close(); }
+
+    /* *** C++ Big Three, intentionally not implemented *** */
+
+    /** Copy constructor, intentionally not implemented */
+    CFileBuffer(const CFileBuffer &) : m_data(NULL), m_size(0), m_map(NULL)
+    {
+        print_error("Error: Copy operator is not implemented.");
+    }
+    /** Copy assignment operator, intentionally not implemented */
+    CFileBuffer& operator= (const CFileBuffer &)
+    {
+        print_error("Error: Copy assignment operator is not implemented.");
+        return(*this);
+    }
+};
+
+/** Bump allocator for character data. Storage is carved sequentially out of
+ * large blocks and is never released individually; everything is freed in
+ * one go when the arena is cleared or destroyed. Allocations are byte
+ * aligned, the arena is only intended for text.
+ */
+class CArena
+{
+    std::vector<char *> m_blocks; /**< All blocks owned by the arena */
+    char *m_next;                 /**< Next free byte of the current block */
+    char *m_limit;                /**< End of the current block */
+    size_t m_size;                /**< Bytes handed out so far */
+
+    /** Start a new block large enough for the allocation
+     * @param[in] n Number of bytes required
+     * @return Storage for n bytes
+     */
+    char *grow(size_t n);
+
+public:
+    /** Constructor */
+    CArena() : m_next(NULL), m_limit(NULL), m_size(0) {}
+
+    /** Allocate storage from the arena. Throws std::bad_alloc if a new block
+     * cannot be allocated.
+     * @param[in] n Number of bytes required
+     * @return Storage for n bytes, valid until the arena is cleared
+     */
+    char *alloc(size_t n)
+    {
+        if ((size_t)(m_limit - m_next) < n)
+            return(grow(n));
+        char *p = m_next;
+        m_next += n;
+        m_size += n;
+        return(p);
+    }
+
+    /** Bytes handed out by the arena
+     * @return Total size of all allocations since the last clear
+     */
+    size_t size() const { return m_size; }
+
+    /** Release every block owned by the arena */
+    void clear();
+
+    /** Take ownership of every block of another arena. Storage handed out
+     * by the other arena stays valid and is now released with this one.
+     * @param[in,out] other Arena to take the blocks from, left empty
+     */
+    void adopt(CArena &other);
+
+    /* *** C++ Big Three *** */
+    ~CArena() { clear(); }
+
+    /* *** C++ Big Three, intentionally not implemented *** */
+
+    /** Copy constructor, intentionally not implemented */
+    CArena(const CArena &) : m_next(NULL), m_limit(NULL), m_size(0)
+    {
+        print_error("Error: Copy operator is not implemented.");
+    }
+    /** Copy assignment operator, intentionally not implemented */
+    CArena& operator= (const CArena &)
+    {
+        print_error("Error: Copy assignment operator is not implemented.");
+        return(*this);
+    }
+};
+
+/** Interning table of the sort keys of names, so records with the same
+ * name share one copy of its key. Each distinct key is held once in a
+ * CArena, NUL terminated and preceded by its 32 bit id, and is found again
+ * through an open addressing hash table. Once every name is in, rank()
+ * numbers the keys in the order they compare, so records can be sorted on
+ * the ranks of their names instead of the names themselves.
+ */
+class CNames
+{
+    /** Slot of the hash table, free while key is NULL */
+    typedef struct
+    {
+        const char *key; //!< Key interned
+        uint32_t hash;   //!< Hash of the key
+        uint32_t len;    //!< Length of the key
+    } s_slot;
+
+    std::vector<char *> m_keys;   /**< Key of each id */
+    std::vector<uint32_t> m_len;  /**< Length of the key of each id */
+    std::vector<uint32_t> m_rank; /**< Rank of each id, see rank() */
+    std::vector<s_slot> m_slots;  /**< Hash table of the keys */
+    size_t m_seen;                /**< Names interned since the last check */
+    size_t m_known;               /**< Keys there were at the last check */
+
+    /** Find the slot of a key, or the free slot it would go in
+     * @param[in] k Key, not NUL terminated
+     * @param[in] n Length of the key
+     * @param[in] h Hash of the key
+     * @return Position in m_slots
+     */
+    size_t find(const char *k, size_t n, uint32_t h) const;
+
+    /** Add an id for a key held in an arena, growing the table as needed
+     * @param[in] k    Key, preceded by room for its id
+     * @param[in] n    Length of the key
+     * @param[in] h    Hash of the key
+     * @param[in] slot Free slot for the key, from find()
+     * @return The key
+     */
+    const char *add(char *k, size_t n, uint32_t h, size_t slot);
+
+public:
+    /** Constructor */
+    CNames() : m_seen(0), m_known(0) {}
+
+    /** Key shared by every name equal to the one given, added to the arena
+     * the first time it is seen
+     * @param[in,out] arena Arena holding the keys of the table
+     * @param[in]     k     Key, not NUL terminated
+     * @param[in]     n     Length of the key
+     * @return Shared copy of the key, NUL terminated
+     */
+    const char *intern(CArena &arena, const char *k, size_t n)
+    {
+        return(intern(arena, k, n, hash(k, n)));
+    }
+
+    /** As intern(arena, k, n), for a key already hashed
+     * @param[in,out] arena Arena holding the keys of the table
+     * @param[in]     k     Key, not NUL terminated
+     * @param[in]     n     Length of the key
+     * @param[in]     h     hash() of the key
+     * @return Shared copy of the key, NUL terminated
+     */
+    const char *intern(CArena &arena, const char *k, size_t n, uint32_t h);
+
+    /** Hash of a key, as the table places it
+     * @param[in] k Key, not NUL terminated
+     * @param[in] n Length of the key
+     * @return Hash
+     */
+    static uint32_t hash(const char *k, size_t n)
+    {
+        return((uint32_t)content_hash(k, n));
+    }
+
+    /** Start fetching the slot a key hashes to, so interning several keys
+     * waits on their slots together rather than one after the other
+     * @param[in] h hash() of the key
+     */
+    void prefetch(uint32_t h) const
+    {
+        if (!m_slots.empty())
+            __builtin_prefetch(&m_slots[h & (m_slots.size() - 1)]);
+    }
+
+    /** Find a key interned by another table
+     * @param[in] other Table the key was interned by
+     * @param[in] i     Id of the key in the other table
+     * @return Shared copy of the key held here, NULL if there is none
+     */
+    const char *lookup(const CNames &other, uint32_t i) const;
+
+    /** Take a key interned by another table into this one, unless it is
+     * here already. The key gets an id of this table, so lookup() whatever
+     * else refers to it by its old id first. The arena of the other table
+     * must have been adopted by the arena of this one.
+     * @param[in] other Table the key was interned by
+     * @param[in] i     Id of the key in the other table
+     */
+    void adopt(const CNames &other, uint32_t i);
+
+    /** Check the names interned still repeat enough for the table to pay.
+     * Names are looked at in windows, each as long as the keys there are
+     * then and at least NAMES_SAMPLE, so a check is cheap enough to make
+     * after every name.
+     * @return FALSE once more than half the names of a window were new
+     */
+    bool repeating();
+
+    /** Number every key in the order strcmp() puts them, see rank(k) */
+    void rank();
+
+    /** Id of a key returned by intern()
+     * @param[in] k Key
+     * @return Id, from 0 up to size()
+     */
+    static uint32_t id(const char *k)
+    {
+        uint32_t i;
+        memcpy(&i, k - sizeof(i), sizeof(i));
+        return(i);
+    }
+
+    /** Rank of a key returned by intern(), as numbered by the last rank()
+     * @param[in] k Key
+     * @return Number of distinct keys ordered before it
+     */
+    uint32_t rank(const char *k) const { return m_rank[id(k)]; }
+
+    /** Number of distinct keys
+     * @return Keys interned since the last clear
+     */
+    size_t size() const { return m_keys.size(); }
+
+    /** Memory held by the table, not counting the keys in the arena
+     * @return Size in bytes
+     */
+    size_t footprint() const
+    {
+        return(m_keys.capacity()*sizeof(char *) +
+               (m_len.capacity() + m_rank.capacity())*sizeof(uint32_t) +
+               m_slots.capacity()*sizeof(s_slot));
+    }
+
+    /** Forget every key, as when their arena is cleared */
+    void clear();
+
+    /* *** C++ Big Three *** */
+    ~CNames() {}
+
+    /* *** C++ Big Three, intentionally not implemented *** */
+
+    /** Copy constructor, intentionally not implemented */
+    CNames(const CNames &) : m_seen(0), m_known(0)
+    {
+        print_error("Error: Copy operator is not implemented.");
+    }
+    /** Copy assignment operator, intentionally not implemented */
+    CNames& operator= (const CNames &)
+    {
+        print_error("Error: Copy assignment operator is not implemented.");
+        return(*this);
+    }
+};
+
+/** Buffered writer to a file descriptor. Output is collected in a large
+ * buffer and handed to the system with one write call each time the buffer
+ * fills, rather than one per line. Numbers are formatted by hand so nothing
+ * goes through iostream or the locale. Errors are sticky: once a write has
+ * failed, everything further is dropped and good() stays FALSE.
+ */
+class CWriter
+{
+    int m_fd;                /**< Destination file descriptor */
+    std::vector<char> m_buf; /**< Output waiting to be written */
+    size_t m_used;           /**< Bytes of m_buf in use */
+    bool m_good;             /**< FALSE once a write has failed */
+    unsigned long long m_written; /**< Bytes written so far */
+
+    /** Write a block straight to the file descriptor
+     * @param[in] p First byte to write
+     * @param[in] n Number of bytes to write
+     */
+    void write_fd(const char *p, size_t n);
+
+public:
+    /** Constructor
+     * @param[in] fd   File descriptor to write to, not closed by the writer
+     * @param[in] size Size of the output buffer
+     */
+    CWriter(int fd, size_t size = FOUT_BLOCK) :
+        m_fd(fd), m_buf(size), m_used(0), m_good(true), m_written(0) {}
+
+    /** Queue bytes for output
+     * @param[in] p First byte to write
+     * @param[in] n Number of bytes to write
+     */
+    void put(const char *p, size_t n)
+    {
+        if (m_buf.size() - m_used < n)
+        {
+            flush();
+            if (n >= m_buf.size())
+            {
+                write_fd(p, n);
+                return;
+            }
+        }
+        memcpy(&m_buf[m_used], p, n);
+        m_used += n;
+    }
+
+    /** Queue a single character for output
+     * @param[in] c Character to write
+     */
+    void put(char c)
+    {
+        if (m_used == m_buf.size())
+            flush();
+        m_buf[m_used++] = c;
+    }
+
+    /** Queue the decimal representation of a number for output
+     * @param[in] v Number to write
+     */
+    void put(unsigned long long v);
+
+    /** Write out everything queued so far
+     * @return TRUE if all output so far has been written successfully
+     */
+    bool flush();
+
+    /** Check for write errors
+     * @return TRUE if no write has failed
+     */
+    bool good() const { return m_good; }
+
+    /** Bytes handed to the system so far
+     * @return Number of bytes written
+     */
+    unsigned long long written() const { return m_written; }
+
+    /* *** C++ Big Three *** */
+    ~CWriter() { flush(); }
+
+    /* *** C++ Big Three, intentionally not implemented *** */
+
+    /** Copy constructor, intentionally not implemented */
+    CWriter(const CWriter &) : m_fd(-1), m_used(0), m_good(false)
+    {
+        print_error("Error: Copy operator is not implemented.");
+    }
+    /** Copy assignment operator, intentionally not implemented */
+    CWriter& operator= (const CWriter &)
+    {
+        print_error("Error: Copy assignment operator is not implemented.");
+        return(*this);
+    }
+};
+
+/** Sorted run of records spilled to a temporary file by an external sort.
+ * Records are written with put() in s_runrow format and read back in the
+ * same order with next(), through a buffer of a size chosen by the merge.
+ * The file is removed as soon as it is created, so it disappears with the
+ * run even if the application does not finish.
+ */
+class CRun
+{
+    int m_fd;                  /**< Temporary file holding the run */
+    unsigned int m_level;      /**< Merges the records have been through */
+    unsigned long long m_rows; /**< Records written to the run */
+    unsigned long long m_left; /**< Records not read back yet */
+    std::vector<char> m_buf;   /**< Bytes read back from the file */
+    size_t m_pos;              /**< Next byte of m_buf to be consumed */
+    size_t m_len;              /**< Bytes of m_buf holding file contents */
+    off_t m_offset;            /**< File offset following m_buf contents */
+    std::string m_lower;       /**< Lower case names of the current record */
+    bool m_collate;            /**< m_lower holds collation keys instead */
+
+    /** Make sure the next bytes of the run are in m_buf
+     * @param[in] n Number of bytes required from m_pos
+     * @return TRUE if n bytes are available, FALSE on read error or end
+     *         of file
+     */
+    bool fill(size_t n);
+
+public:
+    /** Constructor */
+    CRun() : m_fd(-1), m_level(0), m_rows(0), m_left(0), m_pos(0), m_len(0),
+        m_offset(0), m_collate(false) {}
+
+    /** Create the temporary file in $TMPDIR, or #RUN_DIR if it is not set
+     * @param[in] level   Merges the records written will have been through
+     * @param[in] collate Records read back get collation keys rather than
+     *                    lower case names, see CSimpleCSV::collate()
+     * @return TRUE if the file was created, FALSE otherwise
+     */
+    bool create(unsigned int level, bool collate);
+
+    /** Remove the run and everything written to it */
+    void close();
+
+    /** File descriptor to write the run through
+     * @return Open file descriptor of the run
+     */
+    int fd() const { return m_fd; }
+
+    /** Merges the records have been through
+     * @return 0 for a run spilled directly from memory
+     */
+    unsigned int level() const { return m_level; }
+
+    /** Queue a record for the run file
+     * @param[in] o Writer to the file descriptor of the run
+     * @param[in] r Record to be written, records must come in sorted order
+     */
+    void put(CWriter &o, const s_record &r);
+
+    /** Start reading the run back from its first record. All records
+     * written must have been flushed.
+     * @param[in] block Size of the read buffer
+     */
+    void rewind(size_t block);
+
+    /** Read back the next record. The names returned stay valid until the
+     * next call.
+     * @param[out] l  Last name as it was read from the input
+     * @param[out] f  First name as it was read from the input
+     * @param[out] s  Score
+     * @param[out] kl Lower case last name
+     * @param[out] kf Lower case first name
+     * @return TRUE if a record was read, FALSE at the end of the run or on
+     *         a read error, see done()
+     */
+    bool next(s_column &l, s_column &f, unsigned long long &s,
+              const char *&kl, const char *&kf);
+
+    /** Check whether every record has been read back
+     * @return TRUE once next() has returned the last record
+     */
+    bool done() const { return m_left == 0; }
+
+    /* *** C++ Big Three *** */
+    ~CRun() { close(); }
+
+    /* *** C++ Big Three, intentionally not implemented *** */
+
+    /** Copy constructor, intentionally not implemented */
+    CRun(const CRun &) : m_fd(-1), m_level(0), m_rows(0), m_left(0),
+        m_pos(0), m_len(0), m_offset(0), m_collate(false)
+    {
+        print_error("Error: Copy operator is not implemented.");
+    }
+    /** Copy assignment operator, intentionally not implemented */
+    CRun& operator= (const CRun &)
+    {
+        print_error("Error: Copy assignment operator is not implemented.");
+        return(*this);
+    }
+};
+
 /** Simple composite class for reading a CSV file. Note that this class cannot
  * handle and is not intended to handle complex CSV files. If the data row
  * does not match exact specification an error message is shown and the row 
@@ -156,71 +1040,425 @@ public:
 #else
 private:
 #endif
-    std::string m_value[FCOL_MAX];   /**< Row of CSV data */
+    s_column m_value[FCOL_MAX];      /**< Row of CSV data */
     std::vector<s_record> m_records; /**< All valid records read from file */
+    std::vector<uint32_t> m_order;   /**< Sorted order of m_records, empty if
+                                          m_records is itself in order */
+    e_sortmode m_sortmode;           /**< Algorithm used by sort() */
+    unsigned int m_threads;          /**< Threads used by read() and sort(),
+                                          0 for one per CPU */
+    size_t m_split;                  /**< Smallest input slice parsed by one
+                                          thread */
+    size_t m_chunk;                  /**< Block size read from a stream */
+    CArena m_arena;                  /**< Lower case names of all records */
+    CNames m_names;                  /**< Lower case names in m_arena which
+                                          records share, unless m_topk */
+    bool m_interned;                 /**< Lower case names of every record
+                                          are held in m_names, until too
+                                          few of them repeat */
+    bool m_ranked;                   /**< sort() packs the ranks of names
+                                          in m_names into the sort keys */
+    std::string m_key;               /**< Lower case names of the row being
+                                          stored */
+    std::list<CFileBuffer> m_inputs; /**< Files the records refer into */
     unsigned int m_discarded;        /**< Count of discarded rows */
+    std::vector<unsigned long long> m_rejects; /**< Line numbers of
+                                                    discarded rows */
+    unsigned long long m_show;       /**< Line numbers report_rejects()
+                                          shows, the rest are counted */
+    int m_rawfd;                     /**< Discarded rows are written here,
+                                          -1 if they are not kept */
+    std::vector<s_column> m_raw;     /**< Discarded rows not written yet */
+    CDelimScanner m_scan;            /**< Delimiter finder for input buffer */
+    unsigned long long m_topk;       /**< Records kept by read(), 0 for all */
+    std::vector<s_topk> m_heap;      /**< Best m_topk records so far while
+                                          reading, worst at the front */
+    size_t m_live;                   /**< Bytes of m_arena used by m_heap */
+    unsigned long long m_base;       /**< Lines read before the current
+                                          buffer in top-K mode */
+    size_t m_budget;                 /**< Memory for records before they are
+                                          spilled, 0 to keep all in memory */
+    unsigned int m_ways;             /**< Most runs merged at once */
+    std::list<CRun> m_runs;          /**< Sorted runs spilled so far, in
+                                          input order */
+    unsigned long long m_spilled;    /**< Records held in m_runs */
+    bool m_sorted;                   /**< Records are in sorted order through
+                                          m_order, sort() has nothing to do */
+    bool m_cache;                    /**< read() uses a sidecar cache */
+    std::string m_sidecar;           /**< Sidecar cache save_cache() writes,
+                                          empty if it has nothing to write */
+    s_cachehdr m_source;             /**< Input the records were read from */
+    bool m_copy;                     /**< Records hold a copy of their names
+                                          in m_arena, not refer to the input */
+    bool m_collate;                  /**< Sort keys are collation keys */
+    bool m_failed;                   /**< The last read() could not go on,
+                                          the error has been reported */
+    s_stats m_stats;                 /**< Phase timings and counters */
+
+    /** Trim white space around the given column, in place
+     * @param[in,out] v Column to be trimmed
+     */
+    void trim(s_column &v);
+
+    /** Forget the order and discarded rows of the last read, before more
+     * records are read */
+    void start_read();
+
+    /** Top-K mode: sort the records kept in the heap into m_records, then
+     * show the discarded rows of the read */
+    void finish_read();
+
+    /** Parse rows from part of a buffer, storing valid rows as records and
+     * noting the line numbers of discarded rows in m_rejects. The range
+     * must start at the start of a row. Parsing stops, with m_failed set,
+     * at a row which cannot be stored as there are too many records.
+     * @param[in,out] p      First character of the range, advanced to the
+     *                       start of the first row not parsed
+     * @param[in]     e      One past the last character of the range
+     * @param[in]     budget Stop before the next row once footprint()
+     *                       reaches this many bytes
+     * @return Number of lines parsed
+     */
+    unsigned long long parse(const char *&p, const char *e,
+                             size_t budget = SIZE_MAX);
+
+    /** Approximate memory held by the records in memory, including the
+     * key/index pairs sort() builds for them
+     * @return Size in bytes
+     */
+    size_t footprint() const
+    {
+        return(m_records.size()*(sizeof(s_record) + sizeof(s_sortref) +
+                                 sizeof(uint32_t)) + m_arena.size() +
+               m_names.footprint());
+    }
+
+    /** Load the records from the sidecar cache of an input instead of
+     * parsing the input. The cache must have been built from an input of
+     * the same size, modification time and content hash, or from the start
+     * of the input when rows have been appended to it since. If the whole
+     * input is covered the input, which is the last of m_inputs, is
+     * released in favour of the cache.
+     * @param[in]  name  Sidecar cache file name
+     * @param[in]  src   Identity of the input, see m_source
+     * @param[in]  input Contents of the input
+     * @param[out] done  Bytes at the start of the input the cache covers
+     * @return TRUE if the records were loaded, FALSE if there is no usable
+     *         cache and nothing was changed
+     */
+    bool load_cache(const char *name, const s_cachehdr &src,
+                    const CFileBuffer &input, size_t &done);
+
+    /** Sort records appended after records which are already sorted, then
+     * merge the two into one order in m_order. Appended records go after
+     * earlier records they compare equal to, as a full sort would have
+     * them.
+     * @param[in] n Number of leading records already sorted
+     */
+    void sort_appended(size_t n);
+
+    /** External sort: sort the records in memory and move them to a new run
+     * at the end of m_runs. Runs of equal level are merged as they build up
+     * so each record is merged a logarithmic number of times.
+     * @return TRUE if the run was written, FALSE otherwise
+     */
+    bool spill();
+
+    /** External sort: merge the last m_ways runs into one
+     * @return TRUE if the merged run was written, FALSE otherwise
+     */
+    bool merge_tail();
+
+    /** External sort: merge sorted runs. Records which compare equal come
+     * out in the order of the runs they were read from, so the result is
+     * the same as sorting all of them in memory.
+     * @param[in] runs  Runs to merge, in input order
+     * @param[in] o     Writer to send the merged records to
+     * @param[in] limit Maximum number of records to write
+     * @param[in] dest  Run being written to through o, NULL to write the
+     *                  records as text in the format of dump()
+     * @return TRUE if every run was read back, FALSE otherwise
+     */
+    bool merge(const std::vector<CRun*> &runs, CWriter &o,
+               unsigned long long limit, CRun *dest);
+
+    /** Parse a buffer on m_threads threads. The buffer is cut into slices at
+     * row boundaries, each slice is parsed into a CSimpleCSV of its own and
+     * the results are appended here in file order.
+     * @param[in] b First character of the buffer
+     * @param[in] e One past the last character of the buffer
+     * @return Number of lines in the buffer
+     */
+    unsigned long long parse_parallel(const char *b, const char *e);
+
+    /** Show the line numbers of the rows discarded by the last read(), up to
+     * m_show of them followed by the total. The lines are put together and
+     * shown at once. Any discarded rows not written yet are written. */
+    void report_rejects();
+
+    /** Write the discarded rows held in m_raw to m_rawfd, one per line
+     * without their original line ending. A failure is reported and sets
+     * m_failed.
+     * @return TRUE if the rows were written, FALSE otherwise
+     */
+    bool write_raw();
+
+    /** Validate the row held in m_value and store it as a record
+     * @return rwcode_OK if the row was stored, rwcode_DISCARD if it must be
+     *         discarded, rwcode_FAIL if no more records can be held, which
+     *         has been reported
+     */
+    e_rwcode store();
 
-    /** Trim white space around the given string
-     * @param[in] str String to be trimmed
-     * @return std::string instance of the original string with whitespace
-     *         trimmed
+    /** Top-K mode: move the record just stored into the heap of the best
+     * records so far, dropping it or the worst record of the heap. Lower
+     * case names no longer referred to are reclaimed from m_arena once they
+     * outweigh the live ones, so memory stays in proportion to K.
+     * @param[in] line Line of the current buffer the record was read from
      */
-    std::string trim(const std::string &str);
+    void keep(unsigned long long line);
+
+    /** Top-K mode: offer a record to the heap of the best records so far
+     * @param[in] t Record and the input line it was read from
+     */
+    void offer(const s_topk &t);
+
+    /** Bytes of m_arena a record holds
+     * @param[in] r Record
+     * @return Size of its lower case names, and names if m_copy is set
+     */
+    size_t held(const s_record &r) const;
+
+    /** Copy the part of a record m_arena holds to another arena
+     * @param[in,out] r  Record, made to refer to the copy
+     * @param[in,out] to Arena to copy into
+     */
+    void relocate(s_record &r, CArena &to) const;
+
+    /** Copy the names all records and heap entries hold into a fresh arena,
+     * releasing everything else m_arena holds. Records no longer share
+     * their lower case names afterwards. */
+    void compact();
 
     /** Reading in a row needs to handle files created on different platforms
      * which cal lead to combinations of new line \r, \n, \r\n and even \n\r
-     * Note that the underlying system calls to stream and string will throw
-     * exceptions upon fatal errors.
-     * @param[in]  file Open input stream
-     * @param[out] v    Column read from CSV file
+     * The column is not copied, its bounds within the buffer are returned.
+     * Delimiters are located with m_scan, which must have been reset to the
+     * buffer being read.
+     * @param[in,out] p   Current position in the buffer, advanced past the
+     *                    column delimiter or line ending
+     * @param[in]     end One past the last character of the buffer
+     * @param[out]    vb  First character of the column
+     * @param[out]    ve  One past the last character of the column
      * @return Code indicating if column read was completely successfull
      */
-    e_colcode read_col(std::ifstream &file, std::string &v);
+    e_colcode read_col(const char *&p, const char *end,
+                       const char *&vb, const char *&ve);
 
     /** Read a row of the CSV file
-     * @param[in]  file  Open input stream
+     * @param[in,out] p   Current position in the buffer, advanced to the
+     *                    start of the next row
+     * @param[in]     end One past the last character of the buffer
      * @return TRUE if the row was read successfully, FALSE otherwise
      */
-    bool read_row(std::ifstream &file);
+    bool read_row(const char *&p, const char *end);
+
+    /** Sort the records in memory with the algorithm of m_sortmode, see
+     * sort(). Not timed as a phase of its own, spill() calls it while
+     * reading. */
+    void sort_records();
+
+    /** Sort key/index pairs and record the resulting order in m_order,
+     * m_records is left untouched */
+    void sort_index();
+
+    /** Sort key/index pairs on m_threads threads and record the resulting
+     * order in m_order, m_records is left untouched */
+    void sort_parallel();
+
+    /** Counting sort of key/index pairs on score, then sort each run of
+     * equal scores by name. Records the resulting order in m_order.
+     * @return FALSE if the score range exceeds #RADIX_RANGE and nothing was
+     *         sorted, TRUE otherwise
+     */
+    bool sort_radix();
 
-    /** Write the contents of stored records to output stream provided
-     * @param[in] o Stream to send the output to
+    /** Choose how to pack the key/index pairs of records sorted by
+     * comparison, see make_ref()
+     * @param[in]  n      First of the records to be sorted, up to the last
+     * @param[in]  ranked Names are ranked and may be packed as ranks
+     * @param[out] base   Lowest inverted score of the records
+     * @return Packing of the keys
      */
-    void dump(std::ostream &o);
+    e_refkey ref_layout(size_t n, bool ranked, unsigned long long &base) const;
+
+    /** Record the order of sorted key/index pairs in m_order
+     * @param[in] refs Sorted key/index pairs
+     */
+    void set_order(const std::vector<s_sortref> &refs);
+
+    /** Write the contents of stored records to the writer provided. Runs
+     * spilled by an external sort are merged as they are written.
+     * @param[in] o     Writer to send the output to
+     * @param[in] limit Maximum number of records to write
+     * @return TRUE unless a run could not be read back
+     */
+    bool dump(CWriter &o, unsigned long long limit = ULLONG_MAX);
 
 protected:
 public:
     /** Constructor */
-    CSimpleCSV() {}
+    CSimpleCSV() :
+        m_sortmode(sortmode_RADIX), m_threads(1), m_split(READ_SPLIT),
+        m_chunk(FIN_BLOCK), m_interned(true), m_ranked(false),
+        m_discarded(0), m_show(DISCARD_SHOW),
+        m_rawfd(-1), m_topk(0), m_live(0), m_base(0), m_budget(0),
+        m_ways(MERGE_WAYS), m_spilled(0), m_sorted(false), m_cache(false),
+        m_source(), m_copy(false), m_collate(false), m_failed(false),
+        m_stats() {}
 
-    /** Read and store contents of CSV file
-     * @param[in] filename Name of CSV file to read
+    /** Read and store contents of CSV file. The file is mapped (or read in
+     * large blocks) and tokenised directly from memory. When the sidecar
+     * cache is enabled and matches the file, the records, their order and
+     * the discarded lines are loaded from it instead. If rows have only
+     * been appended to the file since the cache was saved, just the new
+     * rows are parsed and merged into the sorted order from the cache.
+     * @param[in] filename Name of CSV file to read, "-" for standard input
      * @return TRUE upon successful read of all data, FALSE otherwise
      */
     e_rwcode read(const char *filename);
 
+    /** Read and store contents of CSV data from a stream such as a pipe.
+     * The stream is read in blocks of m_chunk bytes and the complete rows
+     * of each are parsed as it arrives. In top-K and external sort modes
+     * the records copy their names so each block is let go once parsed and
+     * memory stays bounded, otherwise the blocks are kept with the records.
+     * The sidecar cache is not used.
+     * @param[in] fd Open file descriptor, read up to end of file
+     * @return TRUE upon successful read of all data, FALSE otherwise
+     */
+    e_rwcode read(int fd);
+
     /** Numer of available records
      * @return Number of available records read in from CSV file
      */
-    unsigned int records() { return m_records.size(); }
+    unsigned int records() { return m_spilled + m_records.size(); }
+
+    /** Access a record in output order. Records spilled by an external
+     * sort are not available.
+     * @param[in] i Position of the record, sorted if sort() has been called
+     * @return Reference to the record
+     */
+    const s_record &record(size_t i)
+    {
+        return m_order.empty()?m_records.at(i):m_records.at(m_order.at(i));
+    }
+
+    /** Limit the discarded line numbers read() shows, the rest are only
+     * counted in a summary line
+     * @param[in] n Most line numbers shown, 0 for just the summary
+     */
+    void discards(unsigned long long n) { m_show = n; }
+
+    /** Write the discarded rows to a file as read() goes. Each row is
+     * written as it was read, without its line ending. The sidecar cache
+     * is not used while discarded rows are written, as it has no text of
+     * them.
+     * @param[in] fd File descriptor, -1 to stop writing discarded rows
+     */
+    void rejected(int fd) { m_rawfd = fd; }
+
+    /** Keep only the best k records while reading. read() then holds a
+     * bounded heap of k records instead of every row of the file and leaves
+     * the records it keeps sorted, so memory does not grow with the input.
+     * @param[in] k Number of records to keep, 0 to keep all records
+     */
+    void topk(unsigned long long k) { m_topk = k; }
+
+    /** Sort within a memory budget. read() then parses as many rows as the
+     * budget holds, sorts them and spills them to a sorted run in a
+     * temporary file before going on. save() and print() merge the runs
+     * into their output, which is identical to sorting in memory. Inputs
+     * which fit in the budget are sorted in memory as usual. Ignored in
+     * top-K mode, which needs little memory already, and the input is
+     * parsed on one thread.
+     * @param[in] bytes Memory budget for records, 0 to sort in memory
+     */
+    void budget(size_t bytes) { m_budget = bytes; }
+
+    /** Use a binary sidecar cache, named after the input with #FCACHE_EXT,
+     * to skip parsing and sorting an input which has not changed since the
+     * cache was saved with save_cache(), or all but its appended rows. The
+     * cache is only used when a single file is read in memory, not in top-K
+     * or external sort modes.
+     * @param[in] on TRUE to use the cache
+     */
+    void cache(bool on) { m_cache = on; }
+
+    /** Order names as the LC_COLLATE category of the current locale collates
+     * them, rather than by their bytes in lower case. Each name gets its
+     * strxfrm() key once as it is read, held where the lower case name
+     * would be, so sorting compares bytes just the same and never calls
+     * strcoll(). Keys are longer than the names, so more memory is used.
+     * The sidecar cache is not used, as the keys depend on the locale.
+     * Under a locale which collates bytewise, see bytewise_collation(),
+     * names are folded to lower case as when not collating.
+     * Must be set before anything is read.
+     * @param[in] on TRUE to collate the names
+     */
+    void collate(bool on) { m_collate = on; }
+
+    /** Select the algorithm used by sort(). All algorithms produce the same
+     * order except that sortmode_RECORD leaves records which compare equal
+     * in an unspecified order, the others keep them in the order they were
+     * read.
+     * @param[in] mode Sort algorithm
+     */
+    void sortmode(e_sortmode mode) { m_sortmode = mode; }
+
+    /** Set the number of threads read() and sort() may use. read() parses
+     * slices of large files concurrently, sortmode_PARALLEL splits the whole
+     * sort across them and sortmode_RADIX sorts the names of different
+     * scores concurrently, or falls back to sortmode_PARALLEL rather than
+     * sortmode_INDEX when the scores are too far apart. Records, discards
+     * and the order produced do not depend on the number of threads.
+     * @param[in] n Number of threads, 0 for one per CPU
+     */
+    void threads(unsigned int n) { m_threads = n; }
 
     /** Sort the vector
      * Orders the names by their score. If scores are the same, order by their
-     * last name followed by first name.
+     * last name followed by first name. See sortmode() for the algorithm.
      */
     void sort();
 
+    /** Phase timings and counters of everything done so far
+     * @return Statistics, all zero when built with NOSTATS
+     */
+    const s_stats &stats() const { return m_stats; }
+
     /** Print the contents of stored records to console
+     * @param[in] limit Maximum number of records to print
+     * @param[in] fd    Console file descriptor, stdout by default
+     * @return TRUE if everything was written, FALSE otherwise
      */
-    void print()
-    {
-        dump(std::cout);
-    }
+    bool print(unsigned long long limit = ULLONG_MAX,
+               int fd = STDOUT_FILENO);
 
     /** Save data stored in m_records to specified filename
      * @param[in] filename Destination file name for data
+     * @param[in] limit    Maximum number of records to save
+     */
+    e_rwcode save(const char *filename, unsigned long long limit = ULLONG_MAX);
+
+    /** Write the sidecar cache of the file last read, with the sorted order
+     * if sort() has been called. Nothing is written if the records were
+     * loaded from the cache, come from more than one file or the cache is
+     * not enabled. The cache is written to a temporary name and renamed, so
+     * a reader never sees it half written.
+     * @return rwcode_OK unless the cache could not be written
      */
-    e_rwcode save(const char *filename);
+    e_rwcode save_cache();
 
     /* *** C++ Big Three *** */
     ~CSimpleCSV() {}
@@ -0,0 +1,126 @@
+/* Copyright messages and all buisness related headers go here
+ */
+
+/* Standard C library */
+
+/* Standard C++ library */
+
+/* Project C++ library */
+#include "scan.h"
+
+/* Vector extensions are only built where the compiler can target them per
+ * function, the rest of the application stays at the baseline ISA */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+/* Macros, Functions and Classes */
+/* ----------------------------- */
+
+/** Portable classifier, one byte at a time
+ * @param[in] p Start of the block
+ * @return Bit mask of delimiter positions
+ */
+static uint64_t delim_mask_scalar(const char *p)
+{
+    uint64_t m = 0;
+    for (unsigned int i=0; i<SCAN_BLOCK; ++i)
+    {
+        switch (p[i])
+        {
+        case ',':
+        case '\r':
+        case '\n':
+            m |= 1ULL << i;
+            break;
+        default:
+            break;
+        }
+    }
+    return(m);
+}
+
+#ifdef SCAN_X86
+/** SSE2 classifier, four 16 byte compares per block
+ * @param[in] p Start of the block
+ * @return Bit mask of delimiter positions
+ */
+__attribute__((target("sse2")))
+static uint64_t delim_mask_sse2(const char *p)
+{
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i cr    = _mm_set1_epi8('\r');
+    const __m128i lf    = _mm_set1_epi8('\n');
+    uint64_t m = 0;
+    for (unsigned int i=0; i<SCAN_BLOCK; i+=16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p+i));
+        __m128i d = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, comma),
+                                              _mm_cmpeq_epi8(v, cr)),
+                                 _mm_cmpeq_epi8(v, lf));
+        m |= (uint64_t)(uint16_t)_mm_movemask_epi8(d) << i;
+    }
+    return(m);
+}
+
+/** AVX2 classifier, two 32 byte compares per block
+ * @param[in] p Start of the block
+ * @return Bit mask of delimiter positions
+ */
+__attribute__((target("avx2")))
+static uint64_t delim_mask_avx2(const char *p)
+{
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i cr    = _mm256_set1_epi8('\r');
+    const __m256i lf    = _mm256_set1_epi8('\n');
+    uint64_t m = 0;
+    for (unsigned int i=0; i<SCAN_BLOCK; i+=32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p+i));
+        __m256i d = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_cmpeq_epi8(v, comma),
+                                        _mm256_cmpeq_epi8(v, cr)),
+                        _mm256_cmpeq_epi8(v, lf));
+        m |= (uint64_t)(uint32_t)_mm256_movemask_epi8(d) << i;
+    }
+    return(m);
+}
+#endif
+
+f_delim_mask delim_mask_get(e_simd level)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+#endif
+    switch (level)
+    {
+    case simd_SCALAR:
+        return(delim_mask_scalar);
+#ifdef SCAN_X86
+    case simd_SSE2:
+        return(__builtin_cpu_supports("sse2")?delim_mask_sse2:NULL);
+    case simd_AVX2:
+        return(__builtin_cpu_supports("avx2")?delim_mask_avx2:NULL);
+#endif
+    default:
+        return(NULL);
+    }
+}
+
+/** Pick the widest classifier the running CPU supports
+ * @return Classifier to use by default
+ */
+static f_delim_mask delim_mask_best()
+{
+    f_delim_mask f = NULL;
+    for (int level=simd_MAX-1; !f; --level)
+        f = delim_mask_get((e_simd)level);
+    return(f);
+}
+
+f_delim_mask delim_mask_default()
+{
+    static const f_delim_mask best = delim_mask_best();
+    return(best);
+}
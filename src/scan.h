@@ -0,0 +1,128 @@
+/* Copyright messages and all buisness related headers go here
+ */
+#ifndef _SCAN_H
+#define _SCAN_H
+
+/* Standard C library */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Constants */
+/* --------- */
+
+#define SCAN_BLOCK 64 //!< Bytes classified by one call to a delimiter mask
+
+/* Enumerations */
+/* ------------ */
+
+/** Instruction set used to classify a block of input */
+typedef enum
+{
+    simd_SCALAR = 0, //!< Portable byte at a time fallback
+    simd_SSE2,       //!< 16 bytes per compare
+    simd_AVX2,       //!< 32 bytes per compare
+    simd_MAX         //!< Number of instruction sets
+} e_simd;
+
+/* Macros, Functions and Classes */
+/* ----------------------------- */
+
+/** Classify #SCAN_BLOCK bytes. Bit n of the result is set when p[n] is one
+ * of the CSV delimiters ',', '\\r' or '\\n'.
+ * @param[in] p Start of the block, #SCAN_BLOCK bytes must be readable
+ * @return Bit mask of delimiter positions
+ */
+typedef uint64_t (*f_delim_mask)(const char *p);
+
+/** Get the delimiter classifier for an instruction set
+ * @param[in] level Instruction set required
+ * @return Classifier, NULL if the build or the running CPU lacks support
+ */
+extern f_delim_mask delim_mask_get(e_simd level);
+
+/** Get the best delimiter classifier for the running CPU
+ * @return Classifier for the widest supported instruction set
+ */
+extern f_delim_mask delim_mask_default();
+
+/** Finds delimiters in a buffer. Blocks of #SCAN_BLOCK bytes are classified
+ * in one go and the resulting bit mask is reused across all the columns in
+ * the block, so short columns cost a bit scan rather than a compare per
+ * character.
+ */
+class CDelimScanner
+{
+    const char *m_begin;  /**< Start of buffer being scanned */
+    const char *m_end;    /**< One past the last character of buffer */
+    const char *m_block;  /**< Start of the block described by m_mask */
+    uint64_t m_mask;      /**< Delimiter positions within m_block */
+    f_delim_mask m_fmask; /**< Classifier used for each block */
+
+    /** Classify the block starting at m_block, the final partial block is
+     * padded so the classifier never reads past m_end */
+    void load()
+    {
+        if (m_end - m_block >= SCAN_BLOCK)
+            m_mask = m_fmask(m_block);
+        else
+        {
+            char tail[SCAN_BLOCK] = {0};
+            memcpy(tail, m_block, m_end - m_block);
+            m_mask = m_fmask(tail);
+        }
+    }
+
+public:
+    /** Constructor
+     * @param[in] f Classifier to use, NULL for the best for this CPU
+     */
+    CDelimScanner(f_delim_mask f = NULL) :
+        m_begin(NULL), m_end(NULL), m_block(NULL), m_mask(0), m_fmask(f) {}
+
+    /** Start scanning a new buffer
+     * @param[in] b First character of the buffer
+     * @param[in] e One past the last character of the buffer
+     */
+    void reset(const char *b, const char *e)
+    {
+        if (!m_fmask)
+            m_fmask = delim_mask_default();
+        m_begin = m_block = b;
+        m_end = e;
+        if (b < e)
+            load();
+        else
+            m_mask = 0;
+    }
+
+    /** Find the next delimiter. Calls are cheapest when each one starts in
+     * the same or a later block than the previous result.
+     * @param[in] p Position to start searching from
+     * @return First delimiter at or after p, end of buffer if none
+     */
+    const char *next(const char *p)
+    {
+        size_t off = p - m_block;
+        if (off >= SCAN_BLOCK)
+        {
+            if (p >= m_end)
+                return(m_end);
+            m_block = m_begin + ((p - m_begin) & ~(size_t)(SCAN_BLOCK-1));
+            off = p - m_block;
+            load();
+        }
+        uint64_t m = m_mask & (~0ULL << off);
+        while (!m)
+        {
+            m_block += SCAN_BLOCK;
+            if (m_block >= m_end)
+                return(m_end);
+            load();
+            m = m_mask;
+        }
+        return(m_block + __builtin_ctzll(m));
+    }
+};
+
+#endif
@@ -42,6 +42,7 @@ TESTCASE_WITH_DATA(Filenames_01,
     int argc;
     const char *argv1;
     const char *outName;
+    const char *rejName;
 )
 {
     /* Put together the argv as though it came from a command prompt */
@@ -55,7 +56,9 @@ TESTCASE_WITH_DATA(Filenames_01,
     T_COMPARE(r, true);
     /* Make sure that the destination filename was correctly generated from the
      * source filename */
-    T_COMPARE(strcmp(g_ofname, data->outName), 0);
+    T_COMPARE(g_jobs.size(), 1);
+    T_COMPARE(strcmp(g_jobs[0].ofname, data->outName), 0);
+    T_COMPARE(strcmp(g_jobs[0].rfname, data->rejName), 0);
 }
 /** Data for test case Filenames_01 */
 TESTCASE_POPULATE_DATA(Filenames_01)
@@ -63,50 +66,58 @@ TESTCASE_POPULATE_DATA(Filenames_01)
     .rowName  = "Path and name with leading dots",
     .argc     = ARGC,
     .argv1    = "testdata/..names.txt",
-    .outName  = "testdata/..names-graded.txt"
+    .outName  = "testdata/..names-graded.txt",
+    .rejName  = "testdata/..names-rejected.txt"
 },
 {
     .rowName  = "Path and name with leading dot, no extension",
     .argc     = ARGC,
     .argv1    = "testdata/.names",
-    .outName  = "testdata/.names-graded"
+    .outName  = "testdata/.names-graded",
+    .rejName  = "testdata/.names-rejected"
 },
 {
     .rowName  = "Path and name with leading dot, extension",
     .argc     = ARGC,
     .argv1    = "testdata/.names.txt",
-    .outName  = "testdata/.names-graded.txt"
+    .outName  = "testdata/.names-graded.txt",
+    .rejName  = "testdata/.names-rejected.txt"
 },
 {
     .rowName  = "Path and name, no extension",
     .argc     = ARGC,
     .argv1    = "testdata/names",
-    .outName  = "testdata/names-graded"
+    .outName  = "testdata/names-graded",
+    .rejName  = "testdata/names-rejected"
 },
 {
     .rowName  = "Path and name, extension",
     .argc     = ARGC,
     .argv1    = "testdata/names.txt",
-    .outName  = "testdata/names-graded.txt"
+    .outName  = "testdata/names-graded.txt",
+    .rejName  = "testdata/names-rejected.txt"
 },
 {
     .rowName  = "Path and name, multi extension",
     .argc     = ARGC,
     .argv1    = "testdata/names.txt.t",
-    .outName  = "testdata/names-graded.txt.t"
+    .outName  = "testdata/names-graded.txt.t",
+    .rejName  = "testdata/names-rejected.txt.t"
 },
 {
     .rowName  = "Path and (alt) name, extension",
     .argc     = ARGC,
     .argv1    = "testdata/names2.txt",
-    .outName  = "testdata/names2-graded.txt"
+    .outName  = "testdata/names2-graded.txt",
+    .rejName  = "testdata/names2-rejected.txt"
 },
 TESTCASE_POPULATE_DATA_END
 
 /** Test case will be testing:
  *    . Passing a non existent filename to validate_arg()
  *    . Confirming the return is false
- *    . Confirming global destination filename is unset
+ *    . Confirming no job is left to be graded and the file is counted as
+ *      failed
  */
 TESTCASE(Filenames_02)
 {
@@ -115,14 +126,420 @@ TESTCASE(Filenames_02)
         (char*)"",
         (char*)"this/file/will/never/exist"
     };
-    /* Set the global g_ofname to a random string */
-    strcpy(g_ofname, "ABCxyz");
     /* Execute our function under test */
     bool r=validate_arg(ARGC, argv);
     /* Make sure the return code is always false */
     T_COMPARE(r, false);
-    /* Make sure that the destination filename was correctly unset */
-    T_COMPARE(strcmp(g_ofname, ""), 0);
+    /* Make sure that nothing is left to grade */
+    T_VERIFY(g_jobs.empty());
+    T_COMPARE(g_failed, 1);
+}
+
+/** Test case will be testing:
+ *    . Options are accepted before and after the file name
+ *    . Option values are stored in g_opts
+ *    . Unknown options, bad row counts and a missing file name are rejected
+ *    . Several file names are accepted
+ */
+TESTCASE_WITH_DATA(Options_01,
+    int argc;
+    const char *argv1;
+    const char *argv2;
+    const char *argv3;
+    const char *argv4;
+    bool ok;
+    bool quiet;
+    unsigned long long top;
+    const char *echo;
+    unsigned long long keep;
+    size_t budget;
+    bool cache;
+    bool stats;
+    bool collate;
+    unsigned int threads;
+)
+{
+    /* Put together the argv as though it came from a command prompt */
+    char *argv[] = {
+        (char*)"",
+        (char*)data->argv1,
+        (char*)data->argv2,
+        (char*)data->argv3,
+        (char*)data->argv4
+    };
+    bool r=validate_arg(data->argc, argv);
+    T_COMPARE(r, data->ok);
+    if (!r)
+        return;
+    T_VERIFY(g_jobs.at(0).src == "testdata/names.txt");
+    T_COMPARE(g_opts.quiet, data->quiet);
+    T_VERIFY(g_opts.top == data->top);
+    T_VERIFY(strcmp(g_opts.echo, data->echo) == 0);
+    T_VERIFY(g_opts.keep == data->keep);
+    T_VERIFY(g_opts.budget == data->budget);
+    T_COMPARE(g_opts.cache, data->cache);
+    T_COMPARE(g_opts.collate, data->collate);
+    T_COMPARE(g_opts.threads, data->threads);
+#ifndef NOSTATS
+    T_COMPARE(g_opts.stats, data->stats);
+#endif
+}
+/** Data for test case Options_01 */
+TESTCASE_POPULATE_DATA(Options_01)
+{
+    .rowName  = "Defaults",
+    .argc     = 2,
+    .argv1    = "testdata/names.txt",
+    .argv2    = NULL,
+    .argv3    = NULL,
+    .argv4    = NULL,
+    .ok       = true,
+    .quiet    = false,
+    .top      = ULLONG_MAX,
+    .echo     = "stdout"
+},
+{
+    .rowName  = "Quiet before file",
+    .argc     = 3,
+    .argv1    = "-q",
+    .argv2    = "testdata/names.txt",
+    .argv3    = NULL,
+    .argv4    = NULL,
+    .ok       = true,
+    .quiet    = true,
+    .top      = ULLONG_MAX,
+    .echo     = "stdout"
+},
+{
+    .rowName  = "Echo destination missing",
+    .argc     = 5,
+    .argv1    = "testdata/names.txt",
+    .argv2    = "-n",
+    .argv3    = "10",
+    .argv4    = "-e",
+    .ok       = false
+},
+{
+    .rowName  = "Quiet and echo to file",
+    .argc     = 5,
+    .argv1    = "-q",
+    .argv2    = "testdata/names.txt",
+    .argv3    = "-e",
+    .argv4    = "echo.txt",
+    .ok       = true,
+    .quiet    = true,
+    .top      = ULLONG_MAX,
+    .echo     = "echo.txt"
+},
+{
+    .rowName  = "Top rows",
+    .argc     = 4,
+    .argv1    = "testdata/names.txt",
+    .argv2    = "-n",
+    .argv3    = "10",
+    .argv4    = NULL,
+    .ok       = true,
+    .quiet    = false,
+    .top      = 10,
+    .echo     = "stdout"
+},
+{
+    .rowName  = "Keep top rows",
+    .argc     = 4,
+    .argv1    = "-k",
+    .argv2    = "100",
+    .argv3    = "testdata/names.txt",
+    .argv4    = NULL,
+    .ok       = true,
+    .quiet    = false,
+    .top      = ULLONG_MAX,
+    .echo     = "stdout",
+    .keep     = 100
+},
+{
+    .rowName  = "Memory budget",
+    .argc     = 4,
+    .argv1    = "testdata/names.txt",
+    .argv2    = "-m",
+    .argv3    = "64",
+    .argv4    = NULL,
+    .ok       = true,
+    .quiet    = false,
+    .top      = ULLONG_MAX,
+    .echo     = "stdout",
+    .keep     = 0,
+    .budget   = 64 << 20
+},
+{
+    .rowName  = "Cache",
+    .argc     = 3,
+    .argv1    = "-c",
+    .argv2    = "testdata/names.txt",
+    .argv3    = NULL,
+    .argv4    = NULL,
+    .ok       = true,
+    .quiet    = false,
+    .top      = ULLONG_MAX,
+    .echo     = "stdout",
+    .keep     = 0,
+    .budget   = 0,
+    .cache    = true
+},
+{
+    .rowName  = "Statistics",
+    .argc     = 3,
+    .argv1    = "testdata/names.txt",
+    .argv2    = "--stats",
+    .argv3    = NULL,
+    .argv4    = NULL,
+    .ok       = true,
+    .quiet    = false,
+    .top      = ULLONG_MAX,
+    .echo     = "stdout",
+    .keep     = 0,
+    .budget   = 0,
+    .cache    = false,
+    .stats    = true
+},
+{
+    .rowName  = "Collation",
+    .argc     = 3,
+    .argv1    = "--collate",
+    .argv2    = "testdata/names.txt",
+    .argv3    = NULL,
+    .argv4    = NULL,
+    .ok       = true,
+    .quiet    = false,
+    .top      = ULLONG_MAX,
+    .echo     = "stdout",
+    .keep     = 0,
+    .budget   = 0,
+    .cache    = false,
+    .stats    = false,
+    .collate  = true
+},
+{
+    .rowName  = "Threads",
+    .argc     = 4,
+    .argv1    = "testdata/names.txt",
+    .argv2    = "-t",
+    .argv3    = "8",
+    .argv4    = NULL,
+    .ok       = true,
+    .quiet    = false,
+    .top      = ULLONG_MAX,
+    .echo     = "stdout",
+    .keep     = 0,
+    .budget   = 0,
+    .cache    = false,
+    .stats    = false,
+    .collate  = false,
+    .threads  = 8
+},
+{
+    .rowName  = "Bad thread count",
+    .argc     = 4,
+    .argv1    = "-t",
+    .argv2    = "many",
+    .argv3    = "testdata/names.txt",
+    .argv4    = NULL,
+    .ok       = false
+},
+{
+    .rowName  = "Echo to stderr",
+    .argc     = 4,
+    .argv1    = "-e",
+    .argv2    = "stderr",
+    .argv3    = "testdata/names.txt",
+    .argv4    = NULL,
+    .ok       = true,
+    .quiet    = false,
+    .top      = ULLONG_MAX,
+    .echo     = "stderr"
+},
+{
+    .rowName  = "Bad row count",
+    .argc     = 4,
+    .argv1    = "-n",
+    .argv2    = "ten",
+    .argv3    = "testdata/names.txt",
+    .argv4    = NULL,
+    .ok       = false
+},
+{
+    .rowName  = "Negative row count",
+    .argc     = 4,
+    .argv1    = "-n",
+    .argv2    = "-1",
+    .argv3    = "testdata/names.txt",
+    .argv4    = NULL,
+    .ok       = false
+},
+{
+    .rowName  = "Bad keep count",
+    .argc     = 4,
+    .argv1    = "testdata/names.txt",
+    .argv2    = "-k",
+    .argv3    = "",
+    .argv4    = NULL,
+    .ok       = false
+},
+{
+    .rowName  = "Unknown option",
+    .argc     = 3,
+    .argv1    = "-x",
+    .argv2    = "testdata/names.txt",
+    .argv3    = NULL,
+    .argv4    = NULL,
+    .ok       = false
+},
+{
+    .rowName  = "Options without file",
+    .argc     = 2,
+    .argv1    = "-q",
+    .argv2    = NULL,
+    .argv3    = NULL,
+    .argv4    = NULL,
+    .ok       = false
+},
+{
+    .rowName  = "Two files",
+    .argc     = 3,
+    .argv1    = "testdata/names.txt",
+    .argv2    = "testdata/names2.txt",
+    .argv3    = NULL,
+    .argv4    = NULL,
+    .ok       = true,
+    .quiet    = false,
+    .top      = ULLONG_MAX,
+    .echo     = "stdout"
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Without -t the CPUs are shared among the files graded at once
+ *    . Every file gets at least one thread, and -t overrides the share
+ */
+TESTCASE(Threads_01)
+{
+    unsigned int cpus = thread_count(0); /* Threads of one file alone */
+    g_opts.threads = 0;
+    g_opts.jobs = 2;
+    T_COMPARE(job_threads(1), cpus);
+    T_COMPARE(job_threads(5), std::max(1u, cpus/2));
+    g_opts.jobs = 0;
+    T_COMPARE(job_threads(4*cpus), 1);
+    g_opts.threads = 3;
+    T_COMPARE(job_threads(4*cpus), 3);
+    g_opts.threads = 0;
+}
+
+/** Test case will be testing:
+ *    . A directory stands for the files in it, in name order, leaving out
+ *      graded output and caches but not names merely containing -graded
+ *    . A list file names one input per line, whatever its line endings
+ *    . Inputs which cannot be graded are counted, the others still are
+ *    . A file named more than once, under any path, is graded once
+ */
+TESTCASE(Batch_01)
+{
+    char *argv[] = {
+        (char*)"",
+        (char*)"testdata"
+    };
+    char *list[] = {
+        (char*)"",
+        (char*)"-l",
+        (char*)"testdata/list.tmp"
+    };
+    char *twice[] = {
+        (char*)"",
+        (char*)"testdata/names.txt",
+        (char*)"-l",
+        (char*)"testdata/list.tmp",
+        (char*)"testdata/../testdata/names2.txt"
+    };
+    /* Graded output must be left out of the directory */
+    FILE *f = fopen("testdata/names-graded.txt", "ab");
+    T_VERIFY(f != NULL);
+    fclose(f);
+    /* Unlike a name which only has -graded in it */
+    f = fopen("testdata/team-graded-2024.tmp", "wb");
+    T_VERIFY(f != NULL);
+    fclose(f);
+    bool r = validate_arg(2, argv);
+    unlink("testdata/names-graded.txt");
+    unlink("testdata/team-graded-2024.tmp");
+    T_VERIFY(r);
+    T_COMPARE(g_failed, 0);
+    T_VERIFY(g_jobs.size() >= 5);
+    size_t team = 0; /* Jobs of the file with -graded in its name */
+    for (size_t i=0; i<g_jobs.size(); ++i)
+    {
+        T_VERIFY(g_jobs[i].src.compare(0, 9, "testdata/") == 0);
+        T_VERIFY(g_jobs[i].src != "testdata/names-graded.txt");
+        team += (g_jobs[i].src == "testdata/team-graded-2024.tmp");
+        T_VERIFY((i == 0) || (g_jobs[i-1].src < g_jobs[i].src));
+        if (g_jobs[i].src == "testdata/names.txt")
+            T_VERIFY(strcmp(g_jobs[i].ofname, "testdata/names-graded.txt")
+                     == 0);
+    }
+    T_COMPARE(team, 1);
+    /* List naming a missing file between two good ones */
+    f = fopen("testdata/list.tmp", "wb");
+    T_VERIFY(f != NULL);
+    fputs("testdata/names.txt\r\n\ntestdata/missing.txt\n"
+          "testdata/names2.txt", f);
+    fclose(f);
+    r = validate_arg(3, list);
+    T_VERIFY(r);
+    T_COMPARE(g_failed, 1);
+    T_COMPARE(g_jobs.size(), 2);
+    T_VERIFY(g_jobs[0].src == "testdata/names.txt");
+    T_VERIFY(g_jobs[1].src == "testdata/names2.txt");
+    /* The same files again on the command line and through another path */
+    r = validate_arg(5, twice);
+    unlink("testdata/list.tmp");
+    T_VERIFY(r);
+    T_COMPARE(g_failed, 1);
+    T_COMPARE(g_jobs.size(), 2);
+    T_VERIFY(g_jobs[0].src == "testdata/names.txt");
+    T_VERIFY(g_jobs[1].src == "testdata/names2.txt");
+}
+
+/** Test case will be testing:
+ *    . Standard input graded along with files leaves standard output to
+ *      itself: the files echo to stderr unless -e names a file
+ *    . Standard input graded alone still writes to standard output
+ */
+TESTCASE(Batch_02)
+{
+    char *mixed[] = {
+        (char*)"",
+        (char*)"-",
+        (char*)"testdata/names.txt"
+    };
+    char *named[] = {
+        (char*)"",
+        (char*)"-e",
+        (char*)"echo.tmp",
+        (char*)"testdata/names.txt",
+        (char*)"-"
+    };
+    char *alone[] = {
+        (char*)"",
+        (char*)"-"
+    };
+    T_VERIFY(validate_arg(3, mixed));
+    T_COMPARE(g_jobs.size(), 2);
+    T_COMPARE(g_opts.piped, true);
+    T_VERIFY(strcmp(g_opts.echo, "stderr") == 0);
+    T_VERIFY(validate_arg(5, named));
+    T_COMPARE(g_opts.piped, true);
+    T_VERIFY(strcmp(g_opts.echo, "echo.tmp") == 0);
+    T_VERIFY(validate_arg(2, alone));
+    T_COMPARE(g_opts.piped, false);
+    T_VERIFY(strcmp(g_opts.echo, "stdout") == 0);
 }
 
 /** Test case will be testing:
@@ -151,6 +568,277 @@ TESTCASE(Filenames_03)
     T_COMPARE(csv.m_discarded, 3);
 }
 
+/** Test case will be testing:
+ *    . Rows ending in \r, \n, \r\n and \n\r are all recognised
+ *    . Empty rows and rows with missing columns are discarded
+ *    . A final row without a line ending is accepted
+ * Additional notes. The file name will be tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE(Read_01)
+{
+    static CSimpleCSV csv;   /* CSV file processor */
+    /* Make sure the data is read successfully */
+    T_VERIFY(csv.read("testdata/eol.txt")==rwcode_OK);
+    /* Make sure there are exactly 5 successfully read records */
+    T_COMPARE(csv.records(), 5);
+    /* Make sure there are exactly 2 discarded records */
+    T_COMPARE(csv.m_discarded, 2);
+    /* The row following \n\r must not pick up the stray \r */
+    T_VERIFY(std::string(csv.m_records.at(2).last,
+                         csv.m_records.at(2).last_len) == "KING");
+    T_VERIFY(csv.m_records.at(4).score == 60);
+}
+
+/** Test case will be testing:
+ *    . Parsing a file in many small slices on several threads gives the
+ *      same records, in the same order, as parsing it in one go
+ *    . The discard count and discarded line numbers match the serial parse
+ * Additional notes. The file names which are tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE_WITH_DATA(Read_02,
+    const char *name;
+    size_t split;
+)
+{
+    CSimpleCSV serial;   /* CSV file processor, one thread */
+    CSimpleCSV parallel; /* CSV file processor, sliced input */
+    parallel.threads(4);
+    parallel.m_split = data->split;
+    T_VERIFY(serial.read(data->name)==rwcode_OK);
+    T_VERIFY(parallel.read(data->name)==rwcode_OK);
+    T_COMPARE(parallel.records(), serial.records());
+    T_COMPARE(parallel.m_discarded, serial.m_discarded);
+    T_VERIFY(parallel.m_rejects == serial.m_rejects);
+    for (size_t i=0; i<serial.records(); ++i)
+    {
+        const s_record &r1 = serial.record(i);
+        const s_record &r2 = parallel.record(i);
+        T_VERIFY(std::string(r1.last, r1.last_len) ==
+                 std::string(r2.last, r2.last_len));
+        T_VERIFY(std::string(r1.first, r1.first_len) ==
+                 std::string(r2.first, r2.first_len));
+        T_VERIFY(r1.score == r2.score);
+        T_VERIFY(strcmp(r1.llast, r2.llast) == 0);
+    }
+    /* Slices share the lower case names of the slices before them */
+    T_COMPARE(parallel.m_names.size(), serial.m_names.size());
+}
+/** Data for test case Read_02 */
+TESTCASE_POPULATE_DATA(Read_02)
+{
+    .rowName  = "Discards, 1 byte slices",
+    .name     = "testdata/names2.txt",
+    .split    = 1
+},
+{
+    .rowName  = "Discards, 16 byte slices",
+    .name     = "testdata/names2.txt",
+    .split    = 16
+},
+{
+    .rowName  = "Mixed line endings, 1 byte slices",
+    .name     = "testdata/eol.txt",
+    .split    = 1
+},
+{
+    .rowName  = "Runs of line endings, 1 byte slices",
+    .name     = "testdata/eol2.txt",
+    .split    = 1
+},
+{
+    .rowName  = "Runs of line endings, 7 byte slices",
+    .name     = "testdata/eol2.txt",
+    .split    = 7
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Arena allocations are carved sequentially from the current block
+ *    . Allocations larger than a block are still satisfied
+ *    . Clearing the arena releases everything
+ */
+TESTCASE(Arena_01)
+{
+    CArena arena; /* Arena under test */
+    char *a = arena.alloc(10);
+    char *b = arena.alloc(5);
+    /* Small allocations are contiguous within a block */
+    T_VERIFY(b == a + 10);
+    /* Oversized allocation gets storage of its own and is fully usable */
+    char *c = arena.alloc(ARENA_BLOCK*2);
+    memset(c, 'x', ARENA_BLOCK*2);
+    T_VERIFY(arena.size() == 15 + ARENA_BLOCK*2);
+    arena.clear();
+    T_COMPARE(arena.size(), 0);
+}
+
+/** Test case will be testing:
+ *    . Equal names are interned once, names differing in any byte
+ *      (including after a NUL) are not, however large the table grows
+ *    . Ranks follow strcmp() order
+ *    . Names interned by another table are found and taken over
+ *    . Sorting on ranks gives the same order as sorting on the names
+ */
+TESTCASE(Names_01)
+{
+    CArena arena;  /* Arena holding the names */
+    CNames names;  /* Table under test */
+    CNames other;  /* Table whose names are taken over */
+    const char *a = names.intern(arena, "smith", 5);
+    T_VERIFY(names.intern(arena, "smithx", 5) == a);
+    T_VERIFY(strcmp(a, "smith") == 0);
+    const char *b = names.intern(arena, "smit\0h", 6);
+    T_VERIFY((b != a) && (memcmp(b, "smit\0h", 7) == 0));
+    const char *e = names.intern(arena, "smit", 4);
+    T_VERIFY((e != a) && (e != b));
+    T_VERIFY(names.intern(arena, "", 0) != a);
+    T_COMPARE(names.size(), 4);
+    /* Grow well beyond the initial table, every name keeps its copy */
+    std::vector<const char *> keys;
+    for (int i=0; i<4*NAMES_SLOTS; ++i)
+    {
+        std::string k = std::to_string(i*7919 % 10007);
+        keys.push_back(names.intern(arena, k.data(), k.size()));
+    }
+    T_COMPARE(names.size(), 4 + 4*NAMES_SLOTS);
+    for (int i=0; i<4*NAMES_SLOTS; ++i)
+    {
+        std::string k = std::to_string(i*7919 % 10007);
+        T_VERIFY(names.intern(arena, k.data(), k.size()) == keys[i]);
+        T_VERIFY(CNames::id(keys[i]) == (uint32_t)(4 + i));
+    }
+    names.rank();
+    for (int i=1; i<4*NAMES_SLOTS; ++i)
+    {
+        int c = strcmp(keys[i-1], keys[i]);
+        T_VERIFY((c < 0) == (names.rank(keys[i-1]) < names.rank(keys[i])));
+    }
+    /* Equal up to a NUL compares equal, so ranks equal */
+    T_COMPARE(names.rank(b), names.rank(e));
+    T_COMPARE(names.rank(names.intern(arena, "", 0)), 0);
+    /* Take over the names of another table */
+    CArena more;
+    const char *c = other.intern(more, "smith", 5);
+    const char *d = other.intern(more, "jones", 5);
+    arena.adopt(more);
+    T_VERIFY(names.lookup(other, CNames::id(c)) == a);
+    T_VERIFY(names.lookup(other, CNames::id(d)) == NULL);
+    names.adopt(other, CNames::id(d));
+    T_VERIFY(names.intern(arena, "jones", 5) == d);
+    /* Names repeat enough until a window is mostly new names */
+    CNames window; /* Table checked for repeats */
+    for (int i=0; i<NAMES_SAMPLE; ++i)
+    {
+        std::string k = std::to_string(i % 16);
+        window.intern(arena, k.data(), k.size());
+        T_VERIFY(window.repeating());
+    }
+    for (int i=0; i<NAMES_SAMPLE; ++i)
+    {
+        std::string k = std::to_string(i);
+        window.intern(arena, k.data(), k.size());
+        if (i < NAMES_SAMPLE-1)
+            T_VERIFY(window.repeating());
+    }
+    T_VERIFY(!window.repeating());
+    /* Ranked and unranked sorts agree, in every mode which ranks */
+    static const e_sortmode modes[] =
+        { sortmode_INDEX, sortmode_RADIX, sortmode_PARALLEL };
+    for (size_t i=0; i<sizeof(modes)/sizeof(modes[0]); ++i)
+    {
+        CSimpleCSV ranked;   /* CSV file processor, sorted on ranks */
+        CSimpleCSV unranked; /* CSV file processor, sorted on names */
+        ranked.sortmode(modes[i]);
+        unranked.sortmode(sortmode_INDEX);
+        ranked.threads(3);
+        T_VERIFY(ranked.read("testdata/dups.txt")==rwcode_OK);
+        T_VERIFY(unranked.read("testdata/dups.txt")==rwcode_OK);
+        unranked.m_interned = false;
+        ranked.sort();
+        unranked.sort();
+        T_VERIFY(ranked.m_ranked && !unranked.m_ranked);
+        T_VERIFY(ranked.m_order == unranked.m_order);
+    }
+}
+
+/** Walk every delimiter in a buffer with the scanner and check each one
+ * against a plain byte by byte search.
+ * @param[in] f Delimiter classifier under test
+ * @param[in] b First character of the buffer
+ * @param[in] e One past the last character of the buffer
+ * @param[in] step Maximum distance to skip between searches, 0 to visit
+ *            every delimiter in turn
+ * @return Number of positions where the scanner disagreed
+ */
+static int scan_check(f_delim_mask f, const char *b, const char *e,
+                      unsigned int step)
+{
+    CDelimScanner scan(f); /* Scanner under test */
+    const char *p = b;     /* Search start position */
+    const char *x;         /* Expected delimiter position */
+    int bad = 0;
+    scan.reset(b, e);
+    while (p <= e)
+    {
+        for (x = p; (x < e) && (*x!=',') && (*x!='\r') && (*x!='\n'); ++x);
+        if (scan.next(p) != x)
+            ++bad;
+        p = (step)?(p + rand()%step):(x + 1);
+    }
+    return(bad);
+}
+
+/** Test case will be testing:
+ *    . Each delimiter classifier agrees with a scalar search on the files
+ *      under the "testdata/" folder
+ *    . Each delimiter classifier agrees with a scalar search on a random
+ *      corpus, including buffers shorter than one block
+ */
+TESTCASE_WITH_DATA(Scan_01,
+    e_simd level;
+)
+{
+    static const char *files[] = {
+        "testdata/names.txt", "testdata/names2.txt", "testdata/eol.txt"
+    };
+    static const char alphabet[] = ",\r\n ,aZ9\xc3\xa9\x80\xff";
+    f_delim_mask f = delim_mask_get(data->level);
+    if (!f)
+        T_SKIP("Instruction set not supported on this CPU");
+    for (size_t i=0; i<sizeof(files)/sizeof(files[0]); ++i)
+    {
+        CFileBuffer file;
+        T_VERIFY(file.open(files[i]));
+        T_COMPARE(scan_check(f, file.begin(), file.end(), 0), 0);
+    }
+    srand(1);
+    for (int i=0; i<500; ++i)
+    {
+        std::string fuzz(rand()%(4*SCAN_BLOCK), ' ');
+        for (size_t j=0; j<fuzz.size(); ++j)
+            fuzz[j] = alphabet[rand()%(sizeof(alphabet)-1)];
+        T_COMPARE(scan_check(f, fuzz.data(), fuzz.data()+fuzz.size(), 0), 0);
+        T_COMPARE(scan_check(f, fuzz.data(), fuzz.data()+fuzz.size(), 90), 0);
+    }
+}
+/** Data for test case Scan_01 */
+TESTCASE_POPULATE_DATA(Scan_01)
+{
+    .rowName  = "Scalar",
+    .level    = simd_SCALAR
+},
+{
+    .rowName  = "SSE2",
+    .level    = simd_SSE2
+},
+{
+    .rowName  = "AVX2",
+    .level    = simd_AVX2
+},
+TESTCASE_POPULATE_DATA_END
+
 /** Test case will be testing:
  *    . Veify the source data has not been changed
  *    . Verify the sorted result is per specification
@@ -187,11 +875,11 @@ TESTCASE_WITH_DATA(Sort_01,
 
     /* Test this row of information */
     T_VERIFY(row<csv.m_records.size());
-    /* Get record from csv.m_records */
-    s_record &record = csv.m_records.at(row);
+    /* Get record from csv.m_records in sorted order */
+    const s_record &record = csv.record(row);
     /* Confirm the record */
-    T_VERIFY(strcmp(data->last, record.last.data())==0);
-    T_VERIFY(strcmp(data->first, record.first.data())==0);
+    T_VERIFY(std::string(record.last, record.last_len) == data->last);
+    T_VERIFY(std::string(record.first, record.first_len) == data->first);
     T_VERIFY(data->score == record.score);
 
     /* Post test actions */
@@ -199,6 +887,7 @@ TESTCASE_WITH_DATA(Sort_01,
     {
         /* Clean up */
         csv.m_records.clear();
+        csv.m_order.clear();
     }
     ++row;
 }
@@ -264,6 +953,1180 @@ TESTCASE_POPULATE_DATA(Sort_01)
 },
 TESTCASE_POPULATE_DATA_END
 
+/** Test case will be testing:
+ *    . Every sort mode produces the same order
+ *    . Names which tie on the packed key prefix are ordered by the rest of
+ *      the name
+ *    . Names which end exactly on, before or after the prefix length order
+ *      as strcmp would
+ *    . Case is ignored and bytes above 0x7f order after ASCII
+ * Additional notes. The file name will be tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE_WITH_DATA(Sort_02,
+    e_sortmode mode;
+)
+{
+    static const struct
+    {
+        const char *last;
+        const char *first;
+        unsigned long long score;
+    } expected[] = {
+        { "ZED",        "A",         51 },
+        { "abcdefg",    "X",         50 },
+        { "ABCDEFGH",   "W",         50 },
+        { "ABCDEFGH",   "X",         50 },
+        { "ABCDEFGHI",  "A",         50 },
+        { "abcdefghi",  "B",         50 },
+        { "ABCDEFGHIJ", "Zy",        50 },
+        { "Abcdefghij", "zz",        50 },
+        { "\xc3\x89mile", "Zo\xc3\xab", 50 },
+        { "KING",       "MADISONAA", 40 },
+        { "KING",       "MADISONAB", 40 },
+    };
+    CSimpleCSV csv;          /* CSV file processor */
+    csv.sortmode(data->mode);
+    /* An odd thread count leaves a slice over in the first merge round */
+    csv.threads(3);
+    T_VERIFY(csv.read("testdata/names3.txt")==rwcode_OK);
+    T_COMPARE(csv.records(), sizeof(expected)/sizeof(expected[0]));
+    csv.sort();
+    for (size_t i=0; i<sizeof(expected)/sizeof(expected[0]); ++i)
+    {
+        const s_record &record = csv.record(i);
+        T_VERIFY(std::string(record.last, record.last_len) == expected[i].last);
+        T_VERIFY(std::string(record.first, record.first_len) ==
+                 expected[i].first);
+        T_VERIFY(record.score == expected[i].score);
+    }
+}
+
+/** Data for test case Sort_02 */
+TESTCASE_POPULATE_DATA(Sort_02)
+{
+    .rowName  = "Records",
+    .mode     = sortmode_RECORD
+},
+{
+    .rowName  = "Index",
+    .mode     = sortmode_INDEX
+},
+{
+    .rowName  = "Radix",
+    .mode     = sortmode_RADIX
+},
+{
+    .rowName  = "Parallel",
+    .mode     = sortmode_PARALLEL
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Scores too far apart to pack with a name prefix still sort by score
+ *      then name in every mode
+ *    . Records which compare equal keep their input order
+ * Additional notes. The file name will be tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE_WITH_DATA(Sort_03,
+    e_sortmode mode;
+)
+{
+    static const char *expected[] =
+    {
+        "King, Madison", "king, madison", "KING, MADISONAA",
+        "Abbotsbury, Zed", "Abbotsford, Ann", "abbotsford, Anna",
+        "Abbotsford, Ann", "ABBOTT, Ann", "Abbott, Ann"
+    };
+    CSimpleCSV csv;          /* CSV file processor */
+    csv.sortmode(data->mode);
+    csv.threads(3);
+    T_VERIFY(csv.read("testdata/wide.txt")==rwcode_OK);
+    T_COMPARE(csv.records(), sizeof(expected)/sizeof(expected[0]));
+    csv.sort();
+    for (size_t i=0; i<sizeof(expected)/sizeof(expected[0]); ++i)
+    {
+        const s_record &record = csv.record(i);
+        T_VERIFY(std::string(record.last, record.last_len) + ", " +
+                 std::string(record.first, record.first_len) == expected[i]);
+    }
+    T_VERIFY(csv.record(0).score == ULLONG_MAX);
+    T_VERIFY(csv.record(6).score == 4294967295ULL);
+}
+/** Data for test case Sort_03 */
+TESTCASE_POPULATE_DATA(Sort_03)
+{
+    .rowName  = "Index",
+    .mode     = sortmode_INDEX
+},
+{
+    .rowName  = "Radix",
+    .mode     = sortmode_RADIX
+},
+{
+    .rowName  = "Parallel",
+    .mode     = sortmode_PARALLEL
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Keeping the top records while reading gives the same records, in the
+ *      same order, as the head of a full sort
+ *    . Asking for more records than the file holds keeps them all
+ *    . Discards are still counted when slices keep their own top records
+ * Additional notes. The file names which are tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE_WITH_DATA(TopK_01,
+    const char *name;
+    unsigned long long keep;
+    size_t split;
+)
+{
+    CSimpleCSV full; /* CSV file processor, every record */
+    CSimpleCSV top;  /* CSV file processor, top records only */
+    top.topk(data->keep);
+    top.threads(4);
+    top.m_split = data->split;
+    T_VERIFY(full.read(data->name)==rwcode_OK);
+    T_VERIFY(top.read(data->name)==rwcode_OK);
+    full.sort();
+    T_COMPARE(top.records(),
+              std::min<unsigned long long>(data->keep, full.records()));
+    T_COMPARE(top.m_discarded, full.m_discarded);
+    /* Records are left in order even before sort() */
+    for (size_t i=0; i<top.records(); ++i)
+    {
+        const s_record &r1 = full.record(i);
+        const s_record &r2 = top.record(i);
+        T_VERIFY(std::string(r1.last, r1.last_len) ==
+                 std::string(r2.last, r2.last_len));
+        T_VERIFY(std::string(r1.first, r1.first_len) ==
+                 std::string(r2.first, r2.first_len));
+        T_VERIFY(r1.score == r2.score);
+        T_VERIFY(strcmp(r1.llast, r2.llast) == 0);
+    }
+}
+/** Data for test case TopK_01 */
+TESTCASE_POPULATE_DATA(TopK_01)
+{
+    .rowName  = "Best record",
+    .name     = "testdata/names3.txt",
+    .keep     = 1,
+    .split    = READ_SPLIT
+},
+{
+    .rowName  = "Ties on score",
+    .name     = "testdata/names3.txt",
+    .keep     = 4,
+    .split    = READ_SPLIT
+},
+{
+    .rowName  = "Ties on score, 1 byte slices",
+    .name     = "testdata/names3.txt",
+    .keep     = 4,
+    .split    = 1
+},
+{
+    .rowName  = "Discards, 5 byte slices",
+    .name     = "testdata/names2.txt",
+    .keep     = 3,
+    .split    = 5
+},
+{
+    .rowName  = "More than the file holds",
+    .name     = "testdata/names2.txt",
+    .keep     = 100,
+    .split    = READ_SPLIT
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Read back everything in a file from the start
+ * @param[in] f Open file
+ * @return Contents of the file
+ */
+static std::string file_contents(FILE *f)
+{
+    std::string r;
+    char buf[256];
+    size_t n;
+    rewind(f);
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        r.append(buf, n);
+    return(r);
+}
+
+/** Test case will be testing:
+ *    . Sorting in runs spilled to temporary files writes exactly what the
+ *      in-memory sort writes, including records which compare equal
+ *    . Runs are merged in several levels when there are more than m_ways
+ *    . The runs can be merged again for a shorter echo
+ * Additional notes. The file names which are tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE_WITH_DATA(External_01,
+    const char *name;
+    size_t budget;
+    unsigned int ways;
+)
+{
+    CSimpleCSV full;     /* CSV file processor, in memory */
+    CSimpleCSV external; /* CSV file processor, sorted runs */
+    external.budget(data->budget);
+    external.m_ways = data->ways;
+    T_VERIFY(full.read(data->name)==rwcode_OK);
+    T_VERIFY(external.read(data->name)==rwcode_OK);
+    T_COMPARE(external.records(), full.records());
+    T_VERIFY(external.m_rejects == full.m_rejects);
+    T_VERIFY(!external.m_runs.empty());
+    /* Small files only reach a second level when merging a few at a time */
+    T_VERIFY((data->ways == MERGE_WAYS) ||
+             (external.m_runs.front().level() > 0));
+    full.sort();
+    external.sort();
+    FILE *f1 = tmpfile();
+    FILE *f2 = tmpfile();
+    T_VERIFY((f1 != NULL) && (f2 != NULL));
+    full.print(ULLONG_MAX, fileno(f1));
+    external.print(ULLONG_MAX, fileno(f2));
+    T_VERIFY(file_contents(f1) == file_contents(f2));
+    full.print(2, fileno(f1));
+    external.print(2, fileno(f2));
+    T_VERIFY(file_contents(f1) == file_contents(f2));
+    fclose(f1);
+    fclose(f2);
+}
+/** Data for test case External_01 */
+TESTCASE_POPULATE_DATA(External_01)
+{
+    .rowName  = "One record per run",
+    .name     = "testdata/names3.txt",
+    .budget   = 1,
+    .ways     = MERGE_WAYS
+},
+{
+    .rowName  = "Merged two runs at a time",
+    .name     = "testdata/names3.txt",
+    .budget   = 1,
+    .ways     = 2
+},
+{
+    .rowName  = "Three runs at a time, discards",
+    .name     = "testdata/names2.txt",
+    .budget   = 1,
+    .ways     = 3
+},
+{
+    .rowName  = "Mixed line endings",
+    .name     = "testdata/eol.txt",
+    .budget   = 300,
+    .ways     = 2
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Collated names come out in the order strcoll() gives them in the
+ *      current locale, by score first, or case folded when the locale
+ *      collates bytewise
+ *    . Every sort algorithm, top-K and sorting in runs spilled to temporary
+ *      files agree on that order
+ * Additional notes. The file names which are tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE_WITH_DATA(Collate_01,
+    const char *name;
+    e_sortmode mode;
+    unsigned long long keep;
+    size_t budget;
+)
+{
+    CSimpleCSV full;    /* CSV file processor, collated reference */
+    CSimpleCSV csv;     /* CSV file processor, collated as tested */
+    full.collate(true);
+    full.sortmode(sortmode_INDEX);
+    csv.collate(true);
+    csv.sortmode(data->mode);
+    csv.topk(data->keep);
+    csv.budget(data->budget);
+    T_VERIFY(full.read(data->name)!=rwcode_FAIL);
+    T_VERIFY(csv.read(data->name)!=rwcode_FAIL);
+    full.sort();
+    csv.sort();
+    FILE *f1 = tmpfile();
+    FILE *f2 = tmpfile();
+    T_VERIFY((f1 != NULL) && (f2 != NULL));
+    full.print(data->keep?data->keep:ULLONG_MAX, fileno(f1));
+    csv.print(ULLONG_MAX, fileno(f2));
+    std::string out = file_contents(f2);
+    T_VERIFY(file_contents(f1) == out);
+    fclose(f1);
+    fclose(f2);
+    /* Each line is "last, first, score", check it against the one before */
+    std::istringstream lines(out);
+    std::string line, last, first, plast, pfirst;
+    unsigned long long score, pscore = ULLONG_MAX;
+    /* A locale collating bytewise leaves the names folded to lower case */
+    int (*order)(const char *, const char *) =
+        bytewise_collation()?strcasecmp:strcoll;
+    while (std::getline(lines, line))
+    {
+        size_t a = line.find(", ");
+        size_t b = line.find(", ", a + 2);
+        T_VERIFY((a != std::string::npos) && (b != std::string::npos));
+        last = line.substr(0, a);
+        first = line.substr(a + 2, b - a - 2);
+        score = strtoull(line.c_str() + b + 2, NULL, 10);
+        T_VERIFY(score <= pscore);
+        if (score == pscore)
+        {
+            int c = order(plast.c_str(), last.c_str());
+            T_VERIFY((c < 0) ||
+                     ((c == 0) && (order(pfirst.c_str(), first.c_str()) <= 0)));
+        }
+        plast = last;
+        pfirst = first;
+        pscore = score;
+    }
+}
+/** Data for test case Collate_01 */
+TESTCASE_POPULATE_DATA(Collate_01)
+{
+    .rowName  = "Record sort",
+    .name     = "testdata/names3.txt",
+    .mode     = sortmode_RECORD,
+    .keep     = 0,
+    .budget   = 0
+},
+{
+    .rowName  = "Radix sort",
+    .name     = "testdata/names3.txt",
+    .mode     = sortmode_RADIX,
+    .keep     = 0,
+    .budget   = 0
+},
+{
+    .rowName  = "Parallel sort",
+    .name     = "testdata/names3.txt",
+    .mode     = sortmode_PARALLEL,
+    .keep     = 0,
+    .budget   = 0
+},
+{
+    .rowName  = "Top 5",
+    .name     = "testdata/names3.txt",
+    .mode     = sortmode_INDEX,
+    .keep     = 5,
+    .budget   = 0
+},
+{
+    .rowName  = "One record per run",
+    .name     = "testdata/names3.txt",
+    .mode     = sortmode_INDEX,
+    .keep     = 0,
+    .budget   = 1
+},
+{
+    .rowName  = "Discards",
+    .name     = "testdata/names2.txt",
+    .mode     = sortmode_RADIX,
+    .keep     = 0,
+    .budget   = 0
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Under a locale which collates bytewise, collated names are folded to
+ *      lower case as they are without collating
+ *    . Under a real locale, names are ordered regardless of case and
+ *      accented letters sort with the letters they are based on. Skipped
+ *      when the locale is not installed
+ */
+TESTCASE_WITH_DATA(Collate_02,
+    const char *locale;
+    const char *expect;
+)
+{
+    std::string old = setlocale(LC_COLLATE, NULL); /* Locale to restore */
+    if (!setlocale(LC_COLLATE, data->locale))
+        T_SKIP("Locale not installed");
+    CSimpleCSV csv; /* CSV file processor */
+    csv.collate(true);
+    bool ok = (csv.read("testdata/collate.txt") != rwcode_FAIL);
+    csv.sort();
+    FILE *f = tmpfile();
+    if (f)
+        csv.print(ULLONG_MAX, fileno(f));
+    setlocale(LC_COLLATE, old.c_str());
+    T_VERIFY(ok && (f != NULL));
+    T_VERIFY(file_contents(f) == data->expect);
+    fclose(f);
+}
+
+/** Data for test case Collate_02 */
+TESTCASE_POPULATE_DATA(Collate_02)
+{
+    .rowName  = "Bytewise locale",
+    .locale   = "C",
+    .expect   = "adams, Xavier, 50\nBaker, xander, 50\nBaker, Xavier, 50\n"
+                "eagle, Xavier, 50\nzeta, Xavier, 50\n\xc3\x89lan, Xavier, 50\n"
+},
+{
+    .rowName  = "English locale",
+    .locale   = "en_US.UTF-8",
+    .expect   = "adams, Xavier, 50\nBaker, xander, 50\nBaker, Xavier, 50\n"
+                "eagle, Xavier, 50\n\xc3\x89lan, Xavier, 50\nzeta, Xavier, 50\n"
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . A cache saved after sorting is loaded by the next read, which then
+ *      has nothing left to sort
+ *    . Records, order and discarded lines loaded match the ones parsed
+ *    . A cache which does not match the input is ignored
+ * Additional notes. The file names which are tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE_WITH_DATA(Cache_01,
+    const char *name;
+)
+{
+    std::string cache = std::string(data->name) + FCACHE_EXT;
+    unlink(cache.c_str());
+    CSimpleCSV parsed;  /* CSV file processor, saves the cache */
+    CSimpleCSV loaded;  /* CSV file processor, loads the cache */
+    CSimpleCSV stale;   /* CSV file processor, cache does not match */
+    parsed.cache(true);
+    loaded.cache(true);
+    stale.cache(true);
+    T_VERIFY(parsed.read(data->name)==rwcode_OK);
+    T_VERIFY(!parsed.m_sidecar.empty());
+    parsed.sort();
+    T_VERIFY(parsed.save_cache()==rwcode_OK);
+    T_VERIFY(loaded.read(data->name)==rwcode_OK);
+    T_VERIFY(loaded.m_sidecar.empty());
+    T_VERIFY(loaded.m_sorted);
+    T_COMPARE(loaded.records(), parsed.records());
+    T_VERIFY(loaded.m_rejects == parsed.m_rejects);
+    T_VERIFY(loaded.m_order == parsed.m_order);
+    for (size_t i=0; i<parsed.records(); ++i)
+    {
+        const s_record &r1 = parsed.record(i);
+        const s_record &r2 = loaded.record(i);
+        T_VERIFY(std::string(r1.last, r1.last_len) ==
+                 std::string(r2.last, r2.last_len));
+        T_VERIFY(std::string(r1.first, r1.first_len) ==
+                 std::string(r2.first, r2.first_len));
+        T_VERIFY(r1.score == r2.score);
+        T_VERIFY(strcmp(r1.llast, r2.llast) == 0);
+        T_VERIFY(strcmp(r1.lfirst, r2.lfirst) == 0);
+    }
+    /* Change the content hash the cache was built for */
+    FILE *f = fopen(cache.c_str(), "r+b");
+    T_VERIFY(f != NULL);
+    s_cachehdr h;
+    T_VERIFY(fread(&h, sizeof(h), 1, f) == 1);
+    ++h.hash;
+    rewind(f);
+    T_VERIFY(fwrite(&h, sizeof(h), 1, f) == 1);
+    fclose(f);
+    T_VERIFY(stale.read(data->name)==rwcode_OK);
+    T_VERIFY(!stale.m_sidecar.empty());
+    T_COMPARE(stale.records(), parsed.records());
+    unlink(cache.c_str());
+}
+/** Data for test case Cache_01 */
+TESTCASE_POPULATE_DATA(Cache_01)
+{
+    .rowName  = "Sorted order",
+    .name     = "testdata/names3.txt"
+},
+{
+    .rowName  = "Discards",
+    .name     = "testdata/names2.txt"
+},
+{
+    .rowName  = "Mixed line endings",
+    .name     = "testdata/eol.txt"
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Sort keys in the cache are not trusted, they are built again from
+ *      the lower case names so corrupt keys still give the right order
+ *    . Lower case names which are not the names folded or not NUL
+ *      terminated, an order naming records which do not exist and an order
+ *      which is not sorted all leave the cache unused
+ * Additional notes. The file name which is tested must exist under the
+ * "testdata/" folder, its first row is "ABCDEFGH, X, 50".
+ */
+TESTCASE_WITH_DATA(Cache_03,
+    unsigned long long s_cachehdr::*column;
+    size_t at;
+    bool used;
+)
+{
+    const char *name = "testdata/names3.txt";
+    std::string cache = std::string(name) + FCACHE_EXT;
+    unlink(cache.c_str());
+    CSimpleCSV parsed;  /* CSV file processor, saves the cache */
+    CSimpleCSV loaded;  /* CSV file processor, loads the corrupt cache */
+    parsed.cache(true);
+    loaded.cache(true);
+    T_VERIFY(parsed.read(name)==rwcode_OK);
+    parsed.sort();
+    T_VERIFY(parsed.save_cache()==rwcode_OK);
+    /* Flip every bit of one byte of the body */
+    FILE *f = fopen(cache.c_str(), "r+b");
+    T_VERIFY(f != NULL);
+    s_cachehdr h;
+    T_VERIFY(fread(&h, sizeof(h), 1, f) == 1);
+    T_VERIFY(fseek(f, h.*(data->column) + data->at, SEEK_SET) == 0);
+    int c = fgetc(f);
+    T_VERIFY(c != EOF);
+    T_VERIFY(fseek(f, h.*(data->column) + data->at, SEEK_SET) == 0);
+    fputc(c ^ 0xff, f);
+    fclose(f);
+    T_VERIFY(loaded.read(name)==rwcode_OK);
+    unlink(cache.c_str());
+    T_COMPARE(loaded.m_sidecar.empty(), data->used);
+    loaded.sort();
+    T_COMPARE(loaded.records(), parsed.records());
+    for (size_t i=0; i<parsed.records(); ++i)
+    {
+        const s_record &r1 = parsed.record(i);
+        const s_record &r2 = loaded.record(i);
+        T_VERIFY(std::string(r1.last, r1.last_len) ==
+                 std::string(r2.last, r2.last_len));
+        T_VERIFY(std::string(r1.first, r1.first_len) ==
+                 std::string(r2.first, r2.first_len));
+        T_VERIFY(r1.score == r2.score);
+        T_VERIFY(memcmp(&r1.key, &r2.key, sizeof(r1.key)) == 0);
+    }
+}
+/** Data for test case Cache_03 */
+TESTCASE_POPULATE_DATA(Cache_03)
+{
+    .rowName  = "Last name prefix of the key",
+    .column   = &s_cachehdr::keys_off,
+    .at       = 8,
+    .used     = true
+},
+{
+    .rowName  = "Score of the key",
+    .column   = &s_cachehdr::keys_off,
+    .at       = 7,
+    .used     = false
+},
+{
+    .rowName  = "Lower case name",
+    .column   = &s_cachehdr::lower_off,
+    .at       = 0,
+    .used     = false
+},
+{
+    .rowName  = "NUL after the lower case name",
+    .column   = &s_cachehdr::lower_off,
+    .at       = 8,
+    .used     = false
+},
+{
+    .rowName  = "Order",
+    .column   = &s_cachehdr::order_off,
+    .at       = 3,
+    .used     = false
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Rows appended after a cache was saved are parsed and merged into the
+ *      cached order, giving the records, order and discarded lines of a
+ *      full read and sort
+ *    . Records tied with cached records go after them
+ *    . An input whose cached part did not end a row is read in full
+ */
+TESTCASE_WITH_DATA(Cache_02,
+    const char *head;
+    const char *tail;
+    bool appended;
+)
+{
+    const char *name = "testdata/append.tmp";
+    std::string cache = std::string(name) + FCACHE_EXT;
+    unlink(cache.c_str());
+    FILE *f = fopen(name, "wb");
+    T_VERIFY(f != NULL);
+    fputs(data->head, f);
+    fclose(f);
+    CSimpleCSV first;   /* CSV file processor, saves the cache */
+    CSimpleCSV again;   /* CSV file processor, reads appended rows */
+    CSimpleCSV full;    /* CSV file processor, no cache */
+    first.cache(true);
+    again.cache(true);
+    T_VERIFY(first.read(name)==rwcode_OK);
+    first.sort();
+    T_VERIFY(first.save_cache()==rwcode_OK);
+    f = fopen(name, "ab");
+    T_VERIFY(f != NULL);
+    fputs(data->tail, f);
+    fclose(f);
+    T_VERIFY(again.read(name)==rwcode_OK);
+    /* Only appended rows are parsed, the rest come from the cache */
+    T_COMPARE(again.m_inputs.size(), data->appended?2:1);
+    T_VERIFY(full.read(name)==rwcode_OK);
+    full.sort();
+    again.sort();
+    T_COMPARE(again.records(), full.records());
+    T_VERIFY(again.m_rejects == full.m_rejects);
+    for (size_t i=0; i<full.records(); ++i)
+    {
+        const s_record &r1 = full.record(i);
+        const s_record &r2 = again.record(i);
+        T_VERIFY(std::string(r1.last, r1.last_len) ==
+                 std::string(r2.last, r2.last_len));
+        T_VERIFY(std::string(r1.first, r1.first_len) ==
+                 std::string(r2.first, r2.first_len));
+        T_VERIFY(r1.score == r2.score);
+    }
+    /* The cache saved now covers the whole input */
+    T_VERIFY(again.save_cache()==rwcode_OK);
+    CSimpleCSV last;    /* CSV file processor, loads the new cache */
+    last.cache(true);
+    T_VERIFY(last.read(name)==rwcode_OK);
+    T_VERIFY(last.m_sidecar.empty());
+    T_COMPARE(last.records(), full.records());
+    unlink(cache.c_str());
+    unlink(name);
+}
+/** Data for test case Cache_02 */
+TESTCASE_POPULATE_DATA(Cache_02)
+{
+    .rowName  = "Appended rows",
+    .head     = "KING, MADISON, 88\nSMITH, ALLAN, 70\n",
+    .tail     = "BUNDY, TERESSA, 88\nSMITH, FRANCIS, 85\n",
+    .appended = true
+},
+{
+    .rowName  = "Ties and discards",
+    .head     = "bad row\nKING, Madison, 88\nZED, A, 51\r\n",
+    .tail     = "King, MADISON, 88\n,,\nZED, A, 51\nKING, MADISON, 88\n",
+    .appended = true
+},
+{
+    .rowName  = "Cached part ends mid row",
+    .head     = "KING, MADISON, 88\nSMITH, ALLAN, 7",
+    .tail     = "0\nBUNDY, TERESSA, 88\n",
+    .appended = false
+},
+{
+    .rowName  = "Cached part ends mid line ending",
+    .head     = "KING, MADISON, 88\r",
+    .tail     = "\nSMITH, ALLAN, 70\n",
+    .appended = false
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Reading a stream in blocks gives the records, discarded lines and
+ *      sorted output of reading the whole file, with rows and line endings
+ *      cut across blocks
+ *    . Top-K and external sort modes, which let each block go once parsed
+ *    . Records read earlier are kept when a stream is read after a file
+ * Additional notes. The file names which are tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE_WITH_DATA(Stream_01,
+    const char *name;
+    size_t chunk;
+    unsigned long long keep;
+    size_t budget;
+)
+{
+    CSimpleCSV file;   /* CSV file processor, whole file */
+    CSimpleCSV stream; /* CSV file processor, blocks of the file */
+    file.topk(data->keep);
+    file.budget(data->budget);
+    stream.topk(data->keep);
+    stream.budget(data->budget);
+    stream.m_chunk = data->chunk;
+    T_VERIFY(file.read(data->name)==rwcode_OK);
+    int fd = open(data->name, O_RDONLY);
+    T_VERIFY(fd >= 0);
+    T_VERIFY(stream.read(fd)==rwcode_OK);
+    close(fd);
+    T_COMPARE(stream.records(), file.records());
+    T_VERIFY(stream.m_rejects == file.m_rejects);
+    T_VERIFY(stream.m_copy == (data->keep || data->budget));
+    file.sort();
+    stream.sort();
+    FILE *f1 = tmpfile();
+    FILE *f2 = tmpfile();
+    T_VERIFY((f1 != NULL) && (f2 != NULL));
+    file.print(ULLONG_MAX, fileno(f1));
+    stream.print(ULLONG_MAX, fileno(f2));
+    T_VERIFY(file_contents(f1) == file_contents(f2));
+    /* Both read the file again on top of what they hold */
+    T_VERIFY(file.read(data->name)==rwcode_OK);
+    fd = open(data->name, O_RDONLY);
+    T_VERIFY(fd >= 0);
+    T_VERIFY(stream.read(fd)==rwcode_OK);
+    close(fd);
+    T_COMPARE(stream.records(), file.records());
+    file.sort();
+    stream.sort();
+    file.print(ULLONG_MAX, fileno(f1));
+    stream.print(ULLONG_MAX, fileno(f2));
+    T_VERIFY(file_contents(f1) == file_contents(f2));
+    fclose(f1);
+    fclose(f2);
+}
+/** Data for test case Stream_01 */
+TESTCASE_POPULATE_DATA(Stream_01)
+{
+    .rowName  = "One block",
+    .name     = "testdata/names2.txt",
+    .chunk    = FIN_BLOCK,
+    .keep     = 0,
+    .budget   = 0
+},
+{
+    .rowName  = "1 byte blocks",
+    .name     = "testdata/names2.txt",
+    .chunk    = 1,
+    .keep     = 0,
+    .budget   = 0
+},
+{
+    .rowName  = "Mixed line endings, 3 byte blocks",
+    .name     = "testdata/eol.txt",
+    .chunk    = 3,
+    .keep     = 0,
+    .budget   = 0
+},
+{
+    .rowName  = "Top-K, 7 byte blocks",
+    .name     = "testdata/names3.txt",
+    .chunk    = 7,
+    .keep     = 4,
+    .budget   = 0
+},
+{
+    .rowName  = "External sort, 5 byte blocks",
+    .name     = "testdata/eol.txt",
+    .chunk    = 5,
+    .keep     = 0,
+    .budget   = 300
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Numbers are formatted in decimal exactly as iostream would
+ *    . Output larger than the writer buffer is written in full
+ */
+TESTCASE_WITH_DATA(Write_01,
+    unsigned long long value;
+    const char *text;
+)
+{
+    FILE *f = tmpfile();
+    T_VERIFY(f != NULL);
+    {
+        /* Small buffer so the value is repeatedly split across flushes */
+        CWriter o(fileno(f), 7);
+        for (int i=0; i<10; ++i)
+        {
+            o.put(data->value);
+            o.put(',');
+        }
+        T_VERIFY(o.flush());
+    }
+    std::string expected;
+    for (int i=0; i<10; ++i)
+        expected.append(data->text).append(",");
+    T_VERIFY(file_contents(f) == expected);
+    fclose(f);
+}
+/** Data for test case Write_01 */
+TESTCASE_POPULATE_DATA(Write_01)
+{
+    .rowName  = "Zero",
+    .value    = 0,
+    .text     = "0"
+},
+{
+    .rowName  = "Single digit",
+    .value    = 7,
+    .text     = "7"
+},
+{
+    .rowName  = "Two digits",
+    .value    = 10,
+    .text     = "10"
+},
+{
+    .rowName  = "Odd number of digits",
+    .value    = 100,
+    .text     = "100"
+},
+{
+    .rowName  = "Typical score",
+    .value    = 88,
+    .text     = "88"
+},
+{
+    .rowName  = "Largest score",
+    .value    = ULLONG_MAX,
+    .text     = "18446744073709551615"
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Discarded rows are written as they were read, less their line
+ *      ending, whether the input is a file or a stream cut into blocks
+ *    . Limiting the line numbers shown does not change what is discarded
+ * Additional notes. The file names which are tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE_WITH_DATA(Discard_01,
+    const char *name;
+    size_t chunk;
+    unsigned long long keep;
+    unsigned long long show;
+    unsigned int discarded;
+    const char *raw;
+)
+{
+    CSimpleCSV csv; /* CSV file processor */
+    FILE *f = tmpfile();
+    T_VERIFY(f != NULL);
+    csv.topk(data->keep);
+    csv.discards(data->show);
+    csv.rejected(fileno(f));
+    if (data->chunk)
+    {
+        int fd = open(data->name, O_RDONLY);
+        T_VERIFY(fd >= 0);
+        csv.m_chunk = data->chunk;
+        T_VERIFY(csv.read(fd)==rwcode_OK);
+        close(fd);
+    }
+    else
+        T_VERIFY(csv.read(data->name)==rwcode_OK);
+    T_COMPARE(csv.m_discarded, data->discarded);
+    T_COMPARE(csv.m_rejects.size(), data->discarded);
+    T_VERIFY(csv.m_raw.empty());
+    T_VERIFY(file_contents(f) == data->raw);
+    fclose(f);
+}
+/** Data for test case Discard_01 */
+TESTCASE_POPULATE_DATA(Discard_01)
+{
+    .rowName   = "File",
+    .name      = "testdata/names2.txt",
+    .chunk     = 0,
+    .keep      = 0,
+    .show      = DISCARD_SHOW,
+    .discarded = 3,
+    .raw       = "a,b,100,asasdsad\nb,\nb\n"
+},
+{
+    .rowName   = "Stream, top-K, 1 byte blocks, no line numbers",
+    .name      = "testdata/names2.txt",
+    .chunk     = 1,
+    .keep      = 2,
+    .show      = 0,
+    .discarded = 3,
+    .raw       = "a,b,100,asasdsad\nb,\nb\n"
+},
+{
+    .rowName   = "Mixed line endings, 4 byte blocks, one line number",
+    .name      = "testdata/eol.txt",
+    .chunk     = 4,
+    .keep      = 0,
+    .show      = 1,
+    .discarded = 2,
+    .raw       = "\nb,\n"
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . A discarded rows file which cannot be written fails the read, from a
+ *      file or a stream. Skipped where there is no /dev/full
+ */
+TESTCASE_WITH_DATA(Discard_02,
+    size_t chunk;
+)
+{
+    CSimpleCSV csv; /* CSV file processor */
+    int full = open("/dev/full", O_WRONLY);
+    if (full < 0)
+        T_SKIP("No /dev/full to write to");
+    csv.rejected(full);
+    e_rwcode rc;
+    if (data->chunk)
+    {
+        int fd = open("testdata/names2.txt", O_RDONLY);
+        csv.m_chunk = data->chunk;
+        rc = (fd >= 0)?csv.read(fd):rwcode_OK;
+        if (fd >= 0)
+            close(fd);
+    }
+    else
+        rc = csv.read("testdata/names2.txt");
+    close(full);
+    T_VERIFY(rc == rwcode_FAIL);
+}
+/** Data for test case Discard_02 */
+TESTCASE_POPULATE_DATA(Discard_02)
+{
+    .rowName   = "File",
+    .chunk     = 0
+},
+{
+    .rowName   = "Stream, 16 byte blocks",
+    .chunk     = 16
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Scores of any length up to the largest 64 bit number are converted,
+ *      whether or not they have leading zeros
+ *    . Empty, signed, non numeric and overflowing scores are rejected,
+ *      including bad characters within a group of eight digits
+ */
+TESTCASE_WITH_DATA(Score_01,
+    const char *text;
+    bool ok;
+    unsigned long long value;
+)
+{
+    unsigned long long v = 12345; /* Left alone on failure */
+    const char *b = data->text;
+    bool r = parse_score(b, b + strlen(b), v);
+    T_COMPARE(r, data->ok);
+    T_VERIFY(v == (r?data->value:12345));
+}
+/** Data for test case Score_01 */
+TESTCASE_POPULATE_DATA(Score_01)
+{
+    .rowName  = "Zero",
+    .text     = "0",
+    .ok       = true,
+    .value    = 0
+},
+{
+    .rowName  = "Short",
+    .text     = "88",
+    .ok       = true,
+    .value    = 88
+},
+{
+    .rowName  = "Eight digits",
+    .text     = "12345678",
+    .ok       = true,
+    .value    = 12345678
+},
+{
+    .rowName  = "Seventeen digits",
+    .text     = "12345678901234567",
+    .ok       = true,
+    .value    = 12345678901234567ULL
+},
+{
+    .rowName  = "Largest score",
+    .text     = "18446744073709551615",
+    .ok       = true,
+    .value    = ULLONG_MAX
+},
+{
+    .rowName  = "Leading zeros",
+    .text     = "0000000000000000000000018446744073709551615",
+    .ok       = true,
+    .value    = ULLONG_MAX
+},
+{
+    .rowName  = "Overflow",
+    .text     = "18446744073709551616",
+    .ok       = false
+},
+{
+    .rowName  = "Too many digits",
+    .text     = "100000000000000000000",
+    .ok       = false
+},
+{
+    .rowName  = "Empty",
+    .text     = "",
+    .ok       = false
+},
+{
+    .rowName  = "Negative",
+    .text     = "-5",
+    .ok       = false
+},
+{
+    .rowName  = "Plus sign",
+    .text     = "+5",
+    .ok       = false
+},
+{
+    .rowName  = "Trailing garbage",
+    .text     = "88abc",
+    .ok       = false
+},
+{
+    .rowName  = "Not a number",
+    .text     = "abc",
+    .ok       = false
+},
+{
+    .rowName  = "Bad character in eight digits",
+    .text     = "1234:678",
+    .ok       = false
+},
+{
+    .rowName  = "Bad character after eight digits",
+    .text     = "123456789/",
+    .ok       = false
+},
+{
+    .rowName  = "Inner space",
+    .text     = "12 34",
+    .ok       = false
+},
+TESTCASE_POPULATE_DATA_END
+
+/** Test case will be testing:
+ *    . Every ASCII upper case letter is folded to lower case, whether it is
+ *      in a group of eight characters or in the tail
+ *    . Every other character, including those with the top bit set, is left
+ *      exactly as ::tolower leaves it in the "C" locale
+ *    . The unchanged characters are copied alongside when asked for
+ */
+TESTCASE_WITH_DATA(Fold_01,
+    const char *text;
+)
+{
+    std::string s(data->text);
+    std::string d(s.size() + 1, '#');
+    std::string o(s.size() + 1, '#');
+    const char *b = s.data();
+    char *e = fold_lower(&d[0], b, b + s.size(), &o[0]);
+    T_VERIFY(e == &d[s.size()]);
+    T_COMPARE(d[s.size()], '#');
+    T_VERIFY(o.substr(0, s.size()) == s);
+    for (size_t n=0; n<s.size(); ++n)
+        T_COMPARE((int)(unsigned char)d[n], ::tolower((unsigned char)s[n]));
+    /* Without a copy only the lower case characters are written */
+    std::string l(s.size(), '#');
+    fold_lower(&l[0], b, b + s.size(), NULL);
+    T_VERIFY(l == d.substr(0, s.size()));
+}
+/** Data for test case Fold_01 */
+TESTCASE_POPULATE_DATA(Fold_01)
+{
+    .rowName  = "Empty",
+    .text     = ""
+},
+{
+    .rowName  = "Short",
+    .text     = "McDonald"
+},
+{
+    .rowName  = "Letters and their neighbours",
+    .text     = "@AZ[`az{ @ABCDEFGHIJKLMNOPQRSTUVWXYZ[ `abcdefghijklmnopqrstuvwxyz{"
+},
+{
+    .rowName  = "Top bit set",
+    .text     = "\xc1\xc9\xda\xc0\xdb\x80\xff\xc1Z\xe9"
+},
+{
+    .rowName  = "Mixed case with a tail",
+    .text     = "O'BRIEN-SMITH, Jean-Luc 2"
+},
+TESTCASE_POPULATE_DATA_END
+
+#ifndef NOSTATS
+/** Test case will be testing:
+ *    . Rows accepted and discarded, bytes read and written are counted
+ *    . Records compared while sorting and merging are counted
+ *    . Each phase is timed and the statistics add up over several reads
+ * Additional notes. The file names which are tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE_WITH_DATA(Stats_01,
+    const char *name;
+    size_t budget;
+    unsigned long long accepted;
+    unsigned long long discarded;
+)
+{
+    struct stat st;
+    CSimpleCSV csv; /* CSV file processor */
+    csv.budget(data->budget);
+    T_VERIFY(stat(data->name, &st) == 0);
+    T_VERIFY(csv.read(data->name)==rwcode_OK);
+    const s_stats &s = csv.stats();
+    T_COMPARE(s.bytes_read, (unsigned long long)st.st_size);
+    T_COMPARE(s.rows_accepted, data->accepted);
+    T_COMPARE(s.rows_discarded, data->discarded);
+    T_VERIFY(s.read_ns > 0);
+    T_COMPARE(s.sort_ns, 0);
+    csv.sort();
+    T_VERIFY(s.sort_ns > 0);
+    T_VERIFY(csv.save("testdata/stats-graded.txt")==rwcode_OK);
+    /* Runs spilled one record at a time are only compared as they merge */
+    T_VERIFY(s.comparisons > 0);
+    T_VERIFY(stat("testdata/stats-graded.txt", &st) == 0);
+    T_COMPARE(s.bytes_written, (unsigned long long)st.st_size);
+    T_VERIFY(s.save_ns > 0);
+    unlink("testdata/stats-graded.txt");
+    T_VERIFY(csv.read(data->name)==rwcode_OK);
+    T_COMPARE(s.rows_accepted, 2*data->accepted);
+    T_COMPARE(s.rows_discarded, 2*data->discarded);
+}
+/** Data for test case Stats_01 */
+TESTCASE_POPULATE_DATA(Stats_01)
+{
+    .rowName   = "In memory",
+    .name      = "testdata/names2.txt",
+    .budget    = 0,
+    .accepted  = 8,
+    .discarded = 3
+},
+{
+    .rowName   = "External sort",
+    .name      = "testdata/names2.txt",
+    .budget    = 1,
+    .accepted  = 8,
+    .discarded = 3
+},
+TESTCASE_POPULATE_DATA_END
+#endif
+
+/** Test case will be testing:
+ *    . The saved file has exactly the sorted records in the specified
+ *      format
+ * Additional notes. The file name will be tested must exist under the
+ * "testdata/" folder.
+ */
+TESTCASE(Save_01)
+{
+    static CSimpleCSV csv;   /* CSV file processor */
+    T_VERIFY(csv.read("testdata/names.txt")==rwcode_OK);
+    csv.sort();
+    T_VERIFY(csv.save("testdata/names-graded.txt")==rwcode_OK);
+    FILE *f = fopen("testdata/names-graded.txt", "rb");
+    T_VERIFY(f != NULL);
+    std::string saved = file_contents(f);
+    fclose(f);
+    unlink("testdata/names-graded.txt");
+    T_VERIFY(saved == "BUNDY, TERESSA, 88\n"
+                      "KING, MADISON, 88\n"
+                      "SMITH, FRANCIS, 85\n"
+                      "SMITH, ALLAN, 70\n");
+}
+
 /** Application entry point. This application requires no command line
  * parameters. Normally we would use something like cppunit but this is just
  * a quick test to show unit tests can be written and CI can execute them